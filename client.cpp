@@ -13,25 +13,107 @@
 #include <unistd.h>
 #include <dirent.h>
 #include <netdb.h>
-#include <chrono>
 #include <poll.h>
-#include <map>
+#include <sys/eventfd.h>
+#include <chrono>
 #include <thread>
+#include <atomic>
 
 #include "protocol.hpp"
+#include "compress.hpp"
+#include "dedup.hpp"
+#include "resume.hpp"
+#include "sender.hpp"
+#include "spsc.hpp"
+#include "tuning.hpp"
 
 using namespace std;
-std::chrono::steady_clock::time_point lastReceive;
-bool receiveFlag = false;
-
-struct meta_t {
-    uint32_t offset;
-    uint32_t size;
-    uint32_t seq;
-    uint32_t expected_ack;
-    chrono::system_clock::time_point time;
+
+// A packet as seen by the receive thread, stamped when it came off the socket.
+// The payload is copied in place, so passing ACKs along allocates nothing.
+// The server only ever sends an option block, so that is all there is room for.
+struct ack_event_t {
+    header_t header;
+    chrono::steady_clock::time_point time;
+    size_t size;
+    char payload[MAX_OPTIONS_SIZE];
+};
+
+// Plenty for a full window of ACKs; the receive thread waits if it fills up.
+// About 350 KB, so it isn't kept on the stack.
+typedef SpscQueue<ack_event_t, 1024> AckQueue;
+
+// Lets the sending thread sleep until an ACK arrives or its next timer is
+// due, instead of spinning. The receive thread only pays for the eventfd
+// write while the sending thread is actually asleep.
+class AckSignal {
+public:
+    AckSignal(): fd(eventfd(0, EFD_NONBLOCK)), sleeping(false) {}
+
+    ~AckSignal() {
+        close(fd);
+    }
+
+    // Receive thread, after each push.
+    void notify() {
+        // Pairs with the fence in wait: either the push is seen there, or
+        // sleeping is seen here.
+        atomic_thread_fence(memory_order_seq_cst);
+        if (sleeping.load(memory_order_relaxed)) {
+            uint64_t one = 1;
+            if (write(fd, &one, sizeof one) < 0 && errno != EAGAIN)
+                perror("eventfd write");
+        }
+    }
+
+    // Sending thread: unless acks already has something, waits until
+    // notified or until the given time.
+    void wait(const AckQueue& acks, timestamp_t until) {
+        sleeping.store(true, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (acks.empty()) {
+            // Checked again every second, in case the deadline is far off.
+            auto left = chrono::duration_cast<chrono::nanoseconds>(until - chrono::steady_clock::now());
+            left = max(chrono::nanoseconds(0), min(left, chrono::nanoseconds(chrono::seconds(1))));
+            struct timespec timeout { (time_t) (left.count() / 1000000000), (long) (left.count() % 1000000000) };
+            struct pollfd wake { fd, POLLIN, 0 };
+            ppoll(&wake, 1, &timeout, nullptr);
+        }
+        sleeping.store(false, memory_order_relaxed);
+
+        uint64_t count;
+        if (read(fd, &count, sizeof count) < 0 && errno != EAGAIN)
+            perror("eventfd read");
+    }
+
+private:
+    int fd;
+    atomic<bool> sleeping;
 };
 
+// Receive thread: reads packets as soon as they arrive and hands them to the
+// sending thread, which runs the protocol. Only stops once told to.
+void receiveAcks(int sock, AckQueue& acks, AckSignal& signal, const atomic<bool>& stop) {
+    char buffer[MAX_PACKET_SIZE];
+    while (!stop.load(memory_order_relaxed)) {
+        ssize_t received_size = recvfrom(sock, buffer, sizeof buffer, 0, nullptr, 0);
+        if (received_size < 12 || received_size - 12 > MAX_OPTIONS_SIZE)
+            continue;
+
+        ack_event_t event;
+        event.header = getHeader(buffer, received_size);
+        event.time = chrono::steady_clock::now();
+        event.size = received_size - 12;
+        memcpy(event.payload, buffer + 12, event.size);
+        while (!acks.push(event)) {
+            if (stop.load(memory_order_relaxed))
+                return;
+            this_thread::yield();
+        }
+        signal.notify();
+    }
+}
+
 // Abort connection after 10 seconds of silence from server. Closes socket.
 int abort_connection(int sock) {
     close(sock);
@@ -42,17 +124,72 @@ int main(int argc, const char * argv[]) {
     
     int portNumber, sock;
     struct sockaddr_in socketAddress;
-    int bytes_sent;
-    char buffer[200];
     
     ////////////////////////////////////////////////
     // Validate cml arguments.
     
-    if (argc != 4) {
+    if (argc < 4) {
         std::cerr << "ERROR: Invalid number of arguments. Need IP address, port number, and filename to send";
         
         exit(1);
     }
+
+    // Optional flags after the filename select transfer options to ask the
+    // server for in the SYN.
+    options_t wanted;
+    bool negotiate = false;
+    bool zeroRtt = false;
+    tuning_t tuning;
+    for (int i = 4; i < argc; i++) {
+        string flag(argv[i]);
+        if (parseTuningFlag(argc, argv, i, tuning)) {
+            // --profile NAME or --config FILE, see tuning.hpp
+            continue;
+        } else if (flag == "--compress") {
+            wanted.compress = true;
+            negotiate = true;
+        } else if (flag == "--resume") {
+            wanted.resumeToken = 1;
+            negotiate = true;
+        } else if (flag == "--fec" && i + 1 < argc) {
+            // Send M parity packets for every K data segments, as K+M. M is
+            // the most that will be used; the client sends fewer while
+            // little is lost.
+            int k = 0, m = 0;
+            if (sscanf(argv[++i], "%d+%d", &k, &m) != 2 || k <= 0 || m <= 0 || k > FEC_MAX_K || m > FEC_MAX_M) {
+                std::cerr << "ERROR: --fec takes K+M with K up to " << FEC_MAX_K << " and M up to " << FEC_MAX_M << endl;
+                exit(1);
+            }
+            wanted.fecK = k;
+            wanted.fecM = m;
+            negotiate = true;
+        } else if (flag == "--dedup") {
+            // Only send the chunks of the file the server doesn't have yet.
+            wanted.dedup = true;
+            negotiate = true;
+        } else if (flag == "--preallocate") {
+            // Tell the server the file size even without other options.
+            negotiate = true;
+        } else if (flag == "--zero-rtt") {
+            // Send the start of the file along with the SYN.
+            zeroRtt = true;
+            negotiate = true;
+        } else {
+            std::cerr << "ERROR: Unknown option " << flag << endl;
+            exit(1);
+        }
+    }
+    
+    if (wanted.dedup && (wanted.compress || wanted.resumeToken != 0 || zeroRtt)) {
+        std::cerr << "ERROR: --dedup can't be combined with --compress, --resume or --zero-rtt" << endl;
+        exit(1);
+    }
+
+    string tuningError;
+    if (!checkTuning(tuning, tuningError)) {
+        std::cerr << "ERROR: " << tuningError << endl;
+        exit(1);
+    }
     
     try {
         portNumber = std::stoi(argv[2]);
@@ -108,318 +245,126 @@ int main(int argc, const char * argv[]) {
     socketAddress.sin_addr.s_addr = inet_addr(host);
     socketAddress.sin_port = htons(portNumber);
 
-    ////////////////////////////////////////////////
-    // Format buffer
-    // Send UDP packet src-ip=DEFAULT, src-port=DEFAULT, dst-ip=HOSTNAME-OR-IP, dst-port=PORT with SYN flag set,
-    // Connection ID initialized to 0, Sequence Number set to 12345, and Acknowledgement Number set to 0
-
-    header_t header {
-        12345,
-        0,
-        0,
-        false, true, false
-    };
-
-    auto packetSize = formatSendPacket(buffer, header, nullptr, 0);
-    bytes_sent = sendto(sock, buffer, packetSize, 0,(struct sockaddr*)&socketAddress, sizeof socketAddress);
-    if (bytes_sent < 0) {
-        perror("Sending to server failed.");
-        exit(1);
-    }
-    logClientSend(header, MIN_CWND, INIT_SS_THRESH, false);
-
-    // Timeout after 10 seconds of inactivity from server
-    struct pollfd pfd = {.fd = sock, .events = POLLIN};
-    ret = poll(&pfd, 1, TIMEOUT_TIMER);
-    if (ret <= 0) {
-        // if polling error or timeout
-        abort_connection(sock);
-    }
-
-    ////////////////////////////////////////////////
-    // Listens for server response
-
-    auto recsize = recvfrom(sock, buffer, sizeof buffer, 0, nullptr, 0);
-
-    if (recsize < 0) {
-        std::cerr << "Negative receive size.";
+    // Start the file transfer process. First open the file and get its size,
+    // which the server uses to preallocate the file if we send options anyway.
+    FILE *fd = fopen(argv[3], "rb");
+    if (fd == nullptr) {
+        std::cerr << "ERROR: Failed to open file." << endl;
         exit(1);
     }
-
-    auto synHeader = getHeader(buffer, recsize);
-    logClientRecv(synHeader, MIN_CWND, INIT_SS_THRESH);
-    auto my_cid = synHeader.cid; // use server-assigned connection ID
-
-    ////////////////////////////////////////////////
-    // Set up congestion control
-    
-    // Start the file transfer process. First open the file and get its size.
-    FILE *fd = fopen(argv[3], "rb");
     fseek(fd, 0, SEEK_END);
     
     // Maximum file size 100MB. Using int is fine.
     uint32_t file_size = ftell(fd);
     fseek(fd, 0, SEEK_SET);
 
-    // Set socket to be non-blocking for parallel packet timeout monitoring
-    struct timeval read_timeout;
-    read_timeout.tv_sec = 0;
-    read_timeout.tv_usec = 10;
-    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &read_timeout, sizeof read_timeout);
-
-    // Initialize parameters
-    auto cwnd = MIN_CWND;
-    auto ss_thresh = INIT_SS_THRESH;
-    uint32_t sent_bytes = 0;        // the first byte that is not yet sent
-    uint32_t transmitted_bytes = 0; // the first byte that is not successfully transmitted
-
-    const auto seq_startpoint = synHeader.ack;
-    uint32_t curr_received_seq = synHeader.seq + 1;
+    // A plain SYN stays plain, so servers that don't know options still
+    // understand it.
+    if (negotiate)
+        wanted.fileSize = file_size;
 
-    // bool retransmission_triggered = false;
-    bool firstDataPacket = true;
-
-
-    // Data structure for keeping track of timestamp, include:
-    // sent_bytes (file offset for start of this packet)
-    // actual_payload_size
-    // seq
-    // ack
-    // timestamp
-    vector<meta_t> packet_info;
-
-    // uint32_t outbound_seq = 0;
-    uint32_t received_ack = 0;
-
-
-    ////////////////////////////////////////////////
-    // Send payload with congestion control
-
-    while (transmitted_bytes < (uint32_t) file_size) {
-        if (receiveFlag) {
-            std::chrono::steady_clock::time_point current = std::chrono::steady_clock::now();
-            // timeout after 10
-            if (std::chrono::duration_cast<std::chrono::milliseconds>(current - lastReceive).count() > 10000) {
-                abort_connection(sock);
-            }
+    // The token depends on every other option, so work it out last.
+    if (wanted.resumeToken != 0) {
+        wanted.resumeToken = transferToken(argv[3], wanted.compress);
+        if (wanted.resumeToken == 0) {
+            std::cerr << "ERROR: Failed to read file." << endl;
+            exit(1);
         }
-        ////////////////////////////////////////////////
-        // Sending Packets with CWND
-
-        // Reposition the file descriptor to be at the start of data to be sent
-        fseek(fd, sent_bytes, SEEK_SET);        //TODO: not optimal, moving fd every time
-
-        // Congestion window: send a total of cwnd bytes in several packets
-        while (transmitted_bytes + cwnd > sent_bytes) {
-            // If have cwnd quota left but ran out of file, exit this sending loop
-            if (sent_bytes >= file_size) {
-                break;
-            }
+    }
 
-            // Expected payload size is either max UDP payload size or the remaining cwnd quota
-            auto expected_payload_size = min((uint32_t) MAX_PAYLOAD_SIZE, transmitted_bytes + cwnd - sent_bytes);
-
-            // ofstream myfile;
-            // myfile.open ("debug.txt", std::ios_base::app);
-            // myfile << expected_payload_size << " expected paylod size \n";
-            // myfile << " ---------- \n";
-
-           
-            char buffer[MAX_PACKET_SIZE];
-            char * payloadBuffer = new char [expected_payload_size];
-            bzero(payloadBuffer, expected_payload_size);
-
-            // actual_size might be smaller than the expected payload_size, since we may reach the EOF
-            uint32_t actual_payload_size = fread(payloadBuffer, 1, expected_payload_size, fd);
-            if (actual_payload_size < 0) {
-                std::cerr << "ERROR: Failed to read from file.";
-                fclose(fd);
-                abort_connection(sock);
-            }
+    // With compression the block stream is what goes on the wire, so send
+    // from a temporary file holding it instead of the file itself. It is made
+    // up front since the SYN may already carry the start of it.
+    compress_stats_t stats;
+    FILE *stream = nullptr;
+    if (wanted.compress) {
+        stream = compressFile(fd, stats);
+        if (stream == nullptr) {
+            std::cerr << "ERROR: Failed to compress file." << endl;
+            fclose(fd);
+            exit(1);
+        }
+    }
 
-            // Construct header
-            header_t payloadHeader {
-                (seq_startpoint + sent_bytes) % MAX_SEQ_NUM,
-                curr_received_seq,
-                my_cid,
-                false, false, false
-            };
-
-            if (firstDataPacket) {
-                firstDataPacket = false;
-                payloadHeader.a = true;
-            }
+    // Deduplication sends a manifest of content-defined chunks first, so the
+    // file is split up front too.
+    vector<chunk_t> chunks;
+    if (wanted.dedup && !chunkFile(fd, chunks)) {
+        std::cerr << "ERROR: Failed to split file into chunks." << endl;
+        fclose(fd);
+        exit(1);
+    }
 
-            // Buffer will hold the entire packet (header + payload).
-            packetSize = formatSendPacket(buffer, payloadHeader, payloadBuffer, actual_payload_size);
-            sendto(sock, buffer, packetSize, 0, (struct sockaddr*)&socketAddress, sizeof socketAddress);
-            logClientSend(payloadHeader, cwnd, ss_thresh, false);
- 
-            // Construct meta struct
-            meta_t meta {
-                sent_bytes,
-                (uint32_t) actual_payload_size,
-                payloadHeader.seq,
-                payloadHeader.seq + actual_payload_size,
-                chrono::system_clock::now()
-            };
+    FileSource raw(fd, file_size);
+    FileSource packed(stream, stats.streamBytes);
+    DedupSource chunked(raw, chunks);
 
+    sender_config_t cfg;
+    cfg.wanted = wanted;
+    cfg.negotiate = negotiate;
+    cfg.zeroRtt = zeroRtt;
+    cfg.tuning = tuning;
 
-            // ofstream myfile;
-            // myfile.open ("debug.txt", std::ios_base::app);
-            // myfile << meta.expected_ack << " hi \n";
-            // myfile << " ---------- \n";
+    SystemClock clock;
+    UdpSocket io(sock);
+    Sender sender(clock, io, (struct sockaddr&) socketAddress, raw, stream != nullptr ? &packed : nullptr, cfg, stats,
+                  wanted.dedup ? &chunked : nullptr);
 
+    // Packets are read on their own thread, started before the SYN goes out
+    // so the SYN-ACK is caught too. Its reads time out every few
+    // milliseconds so it notices when it should stop.
+    struct timeval read_timeout;
+    read_timeout.tv_sec = 0;
+    read_timeout.tv_usec = 5000;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &read_timeout, sizeof read_timeout);
+    setSocketBuffers(sock, tuning.sndBuf, tuning.rcvBuf);
+    bool buffersSized = false;
 
-            // Record time in meta data struct
-            packet_info.push_back(meta);
+    static AckQueue acks;
+    AckSignal signal;
+    atomic<bool> stop_receiving(false);
+    thread receiver(receiveAcks, sock, ref(acks), ref(signal), cref(stop_receiving));
 
-            sent_bytes += actual_payload_size;
+    ////////////////////////////////////////////////
+    // Handshake, send payload with congestion control, then disconnect
+
+    // Reused for every ACK, so it stops allocating once it has grown.
+    ack_event_t event;
+    string payload;
+    sender.start();
+    while (!sender.done()) {
+        bool idle = true;
+        while (acks.pop(event)) {
+            idle = false;
+            payload.assign(event.payload, event.size);
+            sender.onPacket(event.header, payload, event.time);
         }
-
-        // ofstream myfile;
-        // myfile.open ("debug.txt", std::ios_base::app);
-        // myfile << transmitted_bytes << " transmitted \n";
-        // myfile << sent_bytes << " sent \n";
-        // myfile << " ---------- \n";
-
-        ////////////////////////////////////////////////
-        // Check Timeout
-
-        auto it = packet_info.begin();
-        while (it != packet_info.end())
-        {
-            auto time_elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::system_clock::now() - it->time).count();
-            
-            //cout << time_elapsed << " time elapsed\n";
-
-            if (time_elapsed > RETRANSMISSION_TIMER) {
-                // If detected timeout
-                sent_bytes = it->offset;
-                ss_thresh = cwnd / 2;
-                cwnd = MIN_CWND;
-                // retransmission_triggered = true;
-                cout << "Retransmitting from \n" << sent_bytes << " seq: " << it->seq << endl;
-                packet_info.clear();
-                break;
-            }
-            else if (it->expected_ack == received_ack) {
-                transmitted_bytes = it->offset + it->size;
-                packet_info.erase(packet_info.begin(), it + 1);
-                break;
-            }
-            ++it;
+        if (sender.poll())
+            idle = false;
+
+        // Once auto tuning has measured the path, the socket buffers are
+        // sized to twice the bandwidth-delay product as well, but never
+        // below the largest window.
+        if (!buffersSized && sender.measuredBdp() > 0) {
+            int size = max(2 * sender.measuredBdp(), (uint32_t) MAX_WINDOW);
+            setSocketBuffers(sock, size, size);
+            buffersSized = true;
         }
 
-        ////////////////////////////////////////////////
-        // Receive Ack
-
-        ssize_t received_size;
-        while ((received_size = recvfrom(sock, buffer, sizeof buffer, 0, nullptr, 0)) > 0) {
-            lastReceive = std::chrono::steady_clock::now();
-            receiveFlag = true;
-            auto ackHeader = getHeader(buffer, received_size);
-            logClientRecv(ackHeader, cwnd, ss_thresh);
-
-            received_ack = ackHeader.ack;
-            
-            // Adjust parameters for successful transmission of one packet
-            if (cwnd < ss_thresh) {
-                cwnd += MAX_PAYLOAD_SIZE;
-            } else {
-                cwnd += MAX_PAYLOAD_SIZE * MAX_PAYLOAD_SIZE / cwnd;
-            }
-        }
-    }
-    
-    
-    // File transfer completed. Start disconnecting.
-    header_t finHeader {
-            received_ack,
-            0,
-            my_cid,
-            false, false, true
-        };
-        
-    // Don't include anything in the payload
-    packetSize = formatSendPacket(buffer, finHeader, nullptr, 0);
-    bytes_sent = sendto(sock, buffer, packetSize, 0,(struct sockaddr*)&socketAddress, sizeof socketAddress);
-    logClientSend(finHeader, cwnd, ss_thresh, false);
-        
-    if (bytes_sent < 0) {
-        std::cerr << "Failed to send FIN packet." << endl;
-        close(sock);
-        exit(1);
-    }
-    
-    // Expect an ACK packet
-    // todo: what if never gets one? Should we include this part in the 2 seconds wait and close the connection after?
-    recsize = recvfrom(sock, buffer, sizeof buffer, 0, nullptr, 0);
-    header_t finAckHeader;
-    if (recsize > 0) {
-        finAckHeader = getHeader(buffer, recsize);
-        logClientRecv(finAckHeader, cwnd, ss_thresh);
-        
-        // Makes it look like reference client.
-        header_t ackFinAckHeader {
-            finAckHeader.ack,
-            finAckHeader.seq + (uint32_t) 1,
-            my_cid,
-            true, false, false
-        };
-        
-        packetSize = formatSendPacket(buffer, ackFinAckHeader, nullptr, 0);
-        bytes_sent = sendto(sock, buffer, packetSize, 0,(struct sockaddr*)&socketAddress, sizeof socketAddress);
-        
-        if (bytes_sent < 0) {
-            std::cerr << "Failed to send the ACK for the FIN-ACK packet.";
-            close(sock);
-            exit(1);
-        }
-        
-        logClientSend(ackFinAckHeader, cwnd, ss_thresh, false);
-    }
-    
-    // Wait for two seconds, responde every FIN packet with an ACK and drop all others.
-    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
-    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
-    
-    // Until 2000 mili seconds passed
-    while (std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() < 2000) {
-        recsize = recvfrom(sock, buffer, sizeof buffer, 0, nullptr, 0);
-        header_t finWaitHeader;
-        
-        if (recsize > 0) {
-            finWaitHeader = getHeader(buffer, recsize);
-            logClientRecv(finWaitHeader, cwnd, ss_thresh);
-
-            if (finWaitHeader.f) {
-                // Weird name but meh
-                header_t ackFinAckHeader {
-                    finWaitHeader.ack,
-                    finWaitHeader.seq + (uint32_t) 1,
-                    my_cid,
-                    true, false, false
-                };
-                
-                packetSize = formatSendPacket(buffer, ackFinAckHeader, nullptr, 0);
-                bytes_sent = sendto(sock, buffer, packetSize, 0,(struct sockaddr*)&socketAddress, sizeof socketAddress);
-                
-                if (bytes_sent < 0) {
-                    std::cerr << "Failed to send the ACK for the FIN-ACK packet.";
-                    close(sock);
-                    exit(1);
-                }
-                logClientSend(ackFinAckHeader, cwnd, ss_thresh, false);
-            }
-        }
-        // Only responds to a FIN packet
-        
-        
-        end = std::chrono::steady_clock::now();
+        // Nothing to send and no ACKs waiting: sleep until an ACK comes in
+        // or a timer is due.
+        if (idle && !sender.done())
+            signal.wait(acks, sender.deadline());
     }
 
+    stop_receiving.store(true);
+    receiver.join();
+    if (stream != nullptr)
+        fclose(stream);
     fclose(fd);
+
+    if (sender.state() == SenderState::ABORTED)
+        abort_connection(sock);
     close(sock);
     return 0;
 }
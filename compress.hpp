@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+#include "lz.hpp"
+#include "util.hpp"
+
+#pragma once
+
+using namespace std;
+
+// Compressed transfers send the file as a stream of blocks, each with a
+// 9 byte frame: kind (1), raw length (4), stored length (4). Blocks that do
+// not shrink are stored as is, so incompressible data only pays the frame.
+
+const size_t COMPRESS_BLOCK_SIZE = 65536;
+const size_t BLOCK_FRAME_SIZE = 9;
+
+#define BLOCK_STORED 0
+#define BLOCK_LZ 1
+
+struct compress_stats_t {
+    uint64_t rawBytes = 0;
+    uint64_t streamBytes = 0;
+    uint32_t blocks = 0;
+    uint32_t storedBlocks = 0;
+
+    double ratio() const {
+        return streamBytes == 0 ? 1.0 : (double) rawBytes / streamBytes;
+    }
+};
+
+// Compresses all of src into a temporary file holding the block stream and
+// returns it rewound, or nullptr on failure. The caller owns the file.
+FILE* compressFile(FILE* src, compress_stats_t& stats) {
+    FILE* out = tmpfile();
+    if (out == nullptr)
+        return nullptr;
+
+    vector<char> raw(COMPRESS_BLOCK_SIZE);
+    string packed;
+    char frame[BLOCK_FRAME_SIZE];
+    size_t n;
+
+    while ((n = fread(raw.data(), 1, raw.size(), src)) > 0) {
+        packed.clear();
+        lzCompress(raw.data(), n, packed);
+
+        bool stored = packed.size() >= n;
+        const char* body = stored ? raw.data() : packed.data();
+        size_t bodySize = stored ? n : packed.size();
+
+        frame[0] = stored ? BLOCK_STORED : BLOCK_LZ;
+        int2buf(frame, n, 1, 5);
+        int2buf(frame, bodySize, 5, 9);
+        if (fwrite(frame, 1, sizeof frame, out) != sizeof frame || fwrite(body, 1, bodySize, out) != bodySize) {
+            fclose(out);
+            return nullptr;
+        }
+
+        stats.rawBytes += n;
+        stats.streamBytes += sizeof frame + bodySize;
+        stats.blocks++;
+        if (stored)
+            stats.storedBlocks++;
+    }
+
+    if (ferror(src)) {
+        fclose(out);
+        return nullptr;
+    }
+    fflush(out);
+    rewind(out);
+    return out;
+}
+
+// Reassembles file data from the in-order block stream on the server. Stream
+// bytes may arrive split anywhere; whole blocks are decoded as they complete.
+struct BlockDecoder {
+    string pending;
+    compress_stats_t stats;
+
+    // Appends decoded data to out. Returns false once the stream is corrupt.
+    bool feed(const char* data, size_t size, string& out) {
+        pending.append(data, size);
+        stats.streamBytes += size;
+
+        size_t pos = 0;
+        while (pending.size() - pos >= BLOCK_FRAME_SIZE) {
+            const char* frame = pending.data() + pos;
+            size_t rawSize = buf2int(frame, 1, 5);
+            size_t bodySize = buf2int(frame, 5, 9);
+            if (rawSize > COMPRESS_BLOCK_SIZE || bodySize > COMPRESS_BLOCK_SIZE)
+                return false;
+            if (pending.size() - pos - BLOCK_FRAME_SIZE < bodySize)
+                break;
+
+            const char* body = frame + BLOCK_FRAME_SIZE;
+            size_t at = out.size();
+            if (frame[0] == BLOCK_STORED) {
+                if (bodySize != rawSize)
+                    return false;
+                out.append(body, bodySize);
+            } else if (frame[0] == BLOCK_LZ) {
+                out.resize(at + rawSize);
+                if (!lzDecompress(body, bodySize, &out[at], rawSize))
+                    return false;
+            } else {
+                return false;
+            }
+
+            stats.rawBytes += rawSize;
+            stats.blocks++;
+            pos += BLOCK_FRAME_SIZE + bodySize;
+        }
+        pending.erase(0, pos);
+        return true;
+    }
+};
@@ -29,6 +29,12 @@ function confundo.dissector(tvb, pInfo, root) -- Tvb, Pinfo, TreeItem
    if bit.band(flag, 4) ~= 0 then
       f:add(tvb(11,1), "ACK")
    end
+   if bit.band(flag, 8) ~= 0 then
+      f:add(tvb(11,1), "OPT")
+   end
+   if bit.band(flag, 16) ~= 0 then
+      f:add(tvb(11,1), "PARITY")
+   end
   
    pInfo.cols.protocol = "Confundo"
 end
@@ -1,8 +1,16 @@
 #include <stdlib.h>
 #include <sys/socket.h>
 #include <map>
+#include <memory>
 #include <string> 
 
+#include "protocol.hpp"
+#include "compress.hpp"
+#include "dedup.hpp"
+#include "fec.hpp"
+#include "resume.hpp"
+#include "storage.hpp"
+
 #pragma once
 
 using namespace std;
@@ -28,6 +36,10 @@ struct Connection {
 
     CState state;
     uint16_t cid;
+    // The ID the client knows the connection by. It only differs from cid
+    // when the ID offered in a SYN cookie was taken by the time the client's
+    // ACK came back.
+    uint16_t wireCid;
 
     struct sockaddr sender;
 
@@ -36,17 +48,46 @@ struct Connection {
     
     uint32_t head;
 
-    FILE* file;
+    // Both sides' initial sequence numbers, and the SYN-ACK to repeat if the
+    // client retransmits its SYN
+    uint32_t isn = 4321;
+    uint32_t peerIsn = 0;
+    header_t synAck;
+    string synAckOptions;
+
+    // Received data goes here, under a temporary name until the FIN
+    unique_ptr<Storage> file;
+    string stagingPath;
 
     uint32_t wrap = 0;
 
+    // Options accepted in the handshake
+    options_t opts;
+
+    // Undoes the block stream when opts.compress is set
+    BlockDecoder decoder;
+
+    // Rebuilds lost segments when opts.fecK is set
+    FecDecoder fec;
+
+    // Assembles the file from the manifest and the chunk store when
+    // opts.dedup is set
+    DedupAssembler dedup;
+
+    // Progress of the transfer, used to checkpoint resumable ones. The
+    // stream counts bytes as sent on the wire, the file counts bytes written.
+    uint32_t streamBytes = 0;
+    uint32_t fileBytes = 0;
+    uint32_t checkpointedBytes = 0;
+
     explicit Connection() {}
 
-    explicit Connection(uint16_t id, sockaddr saddr):
+    explicit Connection(uint16_t id, sockaddr saddr, options_t o = options_t()):
         state( CState::ACK ),
         cid(id),
+        wireCid(id),
         sender(saddr),
         head(12346),
-        file(nullptr) {
+        opts(o) {
         }
 };
\ No newline at end of file
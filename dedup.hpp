@@ -0,0 +1,354 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "sha256.hpp"
+#include "util.hpp"
+
+#pragma once
+
+using namespace std;
+
+// Deduplicated transfers split the file into content-defined chunks: a
+// rolling hash over the last bytes picks the cut points, so an edit only
+// changes the chunks around it and the rest of the file cuts the same way.
+// The stream starts with a manifest of the chunks, 4 bytes of chunk count,
+// then length (4) and digest (16) per chunk. The digest is the first 128 bits
+// of the chunk's SHA-256, so a client can't make a chunk of its own stand in
+// for someone else's. The server looks them up in its chunk store,
+// <dir>/.chunks/<digest in hex>, and answers with the ranges of chunks it
+// needs. The rest of the stream is those chunks, in order.
+
+const char* const CHUNK_DIR = ".chunks";
+const uint32_t DEDUP_MIN_CHUNK = 2048;
+const uint32_t DEDUP_MAX_CHUNK = 65536;
+// The top bits, which depend on all of the last 64 bytes. Cuts every 8 KB on
+// average.
+const uint64_t DEDUP_CUT_MASK = ((1ull << 13) - 1) << 51;
+const size_t DEDUP_DIGEST_SIZE = 16;
+const size_t DEDUP_ENTRY_SIZE = 4 + DEDUP_DIGEST_SIZE;
+const uint32_t DEDUP_MAX_CHUNKS = 1 << 20;
+// The answer has to fit in one option
+const size_t DEDUP_MAX_ANSWER = 255;
+
+struct chunk_t {
+    uint32_t offset;
+    uint32_t size;
+    string digest;
+};
+
+string chunkDigest(Sha256& sha) {
+    return sha.digest().substr(0, DEDUP_DIGEST_SIZE);
+}
+
+string chunkDigest(const char* data, size_t size) {
+    Sha256 sha;
+    sha.update(data, size);
+    return chunkDigest(sha);
+}
+
+// Random values per byte for the gear hash, the same on every host.
+const uint64_t* gearTable() {
+    static uint64_t table[256];
+    static bool ready = false;
+    if (!ready) {
+        uint64_t x = 0x2545f4914f6cdd1dull;
+        for (int i = 0; i < 256; i++) {
+            // splitmix64
+            uint64_t z = (x += 0x9e3779b97f4a7c15ull);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+            table[i] = z ^ (z >> 31);
+        }
+        ready = true;
+    }
+    return table;
+}
+
+// Splits all of src into chunks. The hash shifts one bit per byte, so only
+// the last 64 bytes decide a cut.
+bool chunkFile(FILE* src, vector<chunk_t>& chunks) {
+    const uint64_t* gear = gearTable();
+    vector<char> buf(65536);
+    chunk_t chunk { 0, 0, string() };
+    Sha256 sha;
+    uint64_t rolling = 0;
+    size_t n;
+
+    while ((n = fread(buf.data(), 1, buf.size(), src)) > 0) {
+        size_t start = 0;
+        for (size_t i = 0; i < n; i++) {
+            rolling = (rolling << 1) + gear[(unsigned char) buf[i]];
+            chunk.size++;
+            if ((chunk.size >= DEDUP_MIN_CHUNK && (rolling & DEDUP_CUT_MASK) == 0) || chunk.size == DEDUP_MAX_CHUNK) {
+                sha.update(buf.data() + start, i + 1 - start);
+                chunk.digest = chunkDigest(sha);
+                chunks.push_back(chunk);
+                chunk = chunk_t { chunk.offset + chunk.size, 0, string() };
+                sha = Sha256();
+                rolling = 0;
+                start = i + 1;
+            }
+        }
+        sha.update(buf.data() + start, n - start);
+    }
+    if (chunk.size > 0) {
+        chunk.digest = chunkDigest(sha);
+        chunks.push_back(chunk);
+    }
+    return !ferror(src) && chunks.size() <= DEDUP_MAX_CHUNKS;
+}
+
+string formatManifest(const vector<chunk_t>& chunks) {
+    string manifest(4 + chunks.size() * DEDUP_ENTRY_SIZE, '\0');
+    int2buf(&manifest[0], chunks.size(), 0, 4);
+    for (size_t i = 0; i < chunks.size(); i++) {
+        char* entry = &manifest[4 + i * DEDUP_ENTRY_SIZE];
+        int2buf(entry, chunks[i].size, 0, 4);
+        memcpy(entry + 4, chunks[i].digest.data(), DEDUP_DIGEST_SIZE);
+    }
+    return manifest;
+}
+
+// Ranges of chunk indexes, as (first, count).
+typedef vector<pair<uint32_t, uint32_t>> chunk_ranges_t;
+
+void putVarint(string& out, uint32_t v) {
+    while (v >= 0x80) {
+        out += (char) (v | 0x80);
+        v >>= 7;
+    }
+    out += (char) v;
+}
+
+bool getVarint(const string& in, size_t& pos, uint32_t& v) {
+    v = 0;
+    for (int shift = 0; shift < 35 && pos < in.size(); shift += 7) {
+        uint8_t b = in[pos++];
+        v |= (uint32_t) (b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return true;
+    }
+    return false;
+}
+
+// Encodes the ranges as (gap since the previous range, count) varints. If
+// that doesn't fit in DEDUP_MAX_ANSWER, ranges with ever larger gaps between
+// them are merged: asking for a chunk the server has costs bandwidth, not
+// correctness. ranges is updated to what was encoded.
+string formatRanges(chunk_ranges_t& ranges) {
+    for (uint32_t mergeGap = 0;; mergeGap = mergeGap * 2 + 1) {
+        chunk_ranges_t merged;
+        for (auto& range: ranges) {
+            if (!merged.empty() && range.first - (merged.back().first + merged.back().second) <= mergeGap)
+                merged.back().second = range.first + range.second - merged.back().first;
+            else
+                merged.push_back(range);
+        }
+
+        string out;
+        uint32_t end = 0;
+        for (auto& range: merged) {
+            putVarint(out, range.first - end);
+            putVarint(out, range.second);
+            end = range.first + range.second;
+        }
+        if (out.size() <= DEDUP_MAX_ANSWER) {
+            ranges = merged;
+            return out;
+        }
+    }
+}
+
+// Decodes ranges of chunks below count. Returns false if they are malformed.
+bool parseRanges(const string& in, uint32_t count, chunk_ranges_t& ranges) {
+    size_t pos = 0;
+    uint32_t end = 0;
+    while (pos < in.size()) {
+        uint32_t gap, n;
+        if (!getVarint(in, pos, gap) || !getVarint(in, pos, n) || n == 0 ||
+            gap > count - end || n > count - end - gap)
+            return false;
+        ranges.push_back(make_pair(end + gap, n));
+        end += gap + n;
+    }
+    return true;
+}
+
+string chunkPath(const string& dir, const string& digest) {
+    static const char* hex = "0123456789abcdef";
+    string name;
+    for (unsigned char c: digest) {
+        name += hex[c >> 4];
+        name += hex[c & 15];
+    }
+    return dir + "/" + CHUNK_DIR + "/" + name;
+}
+
+struct dedup_stats_t {
+    uint32_t chunks = 0;
+    uint32_t sentChunks = 0;
+    uint64_t rawBytes = 0;
+    uint64_t sentBytes = 0;
+};
+
+// Reassembles a deduplicated transfer on the server from the in-order
+// stream. Once the manifest is in, answer holds the encoded ranges of chunks
+// the client has to send. File data is handed to write in order, from the
+// stream or from the chunk store; received chunks are added to the store.
+struct DedupAssembler {
+    string dir;
+    string pending;
+    vector<chunk_t> chunks;
+    vector<bool> wanted;
+    size_t manifestSize = 0;
+    bool manifestDone = false;
+    size_t next = 0; // the first chunk not yet written
+    string answer;
+    dedup_stats_t stats;
+
+    // Returns false once the stream is corrupt or a chunk can't be read or
+    // stored: a later copy of it in this file, or the next file, counts on
+    // finding it in the store.
+    bool feed(const char* data, size_t size, const function<bool(const char*, size_t)>& write) {
+        pending.append(data, size);
+        if (!manifestDone && !readManifest())
+            return false;
+
+        while (manifestDone && next < chunks.size()) {
+            auto& chunk = chunks[next];
+            if (wanted[next]) {
+                if (pending.size() < chunk.size)
+                    break;
+                if (chunkDigest(pending.data(), chunk.size) != chunk.digest)
+                    return false;
+                if (!write(pending.data(), chunk.size) || !storeChunk(chunk.digest, pending.data(), chunk.size))
+                    return false;
+                pending.erase(0, chunk.size);
+            } else {
+                string stored;
+                if (!loadChunk(chunk, stored) || !write(stored.data(), stored.size()))
+                    return false;
+            }
+            next++;
+        }
+        return true;
+    }
+
+    // Whether the manifest is in and the client hasn't started on the chunks
+    // yet, going by how much of the stream arrived.
+    bool awaitingChunks(uint64_t streamBytes) const {
+        return manifestDone && streamBytes == manifestSize;
+    }
+
+    bool complete() const {
+        return manifestDone && next == chunks.size() && pending.empty();
+    }
+
+private:
+    size_t manifestNeeded() const {
+        if (pending.size() < 4)
+            return 4;
+        return 4 + (size_t) buf2int(pending.data(), 0, 4) * DEDUP_ENTRY_SIZE;
+    }
+
+    // Parses the manifest once all of it is there and works out the answer.
+    // A chunk is only asked for once, even if the file repeats it. Returns
+    // false if the manifest is malformed.
+    bool readManifest() {
+        if (pending.size() < 4)
+            return true;
+        uint32_t count = buf2int(pending.data(), 0, 4);
+        if (count > DEDUP_MAX_CHUNKS)
+            return false;
+        if (pending.size() < manifestNeeded())
+            return true;
+
+        mkdir((dir + "/" + CHUNK_DIR).c_str(), 0755);
+        chunk_ranges_t ranges;
+        unordered_set<string> asked;
+        uint32_t offset = 0;
+        for (uint32_t i = 0; i < count; i++) {
+            const char* entry = pending.data() + 4 + i * DEDUP_ENTRY_SIZE;
+            chunk_t chunk { offset, buf2int(entry, 0, 4), string(entry + 4, DEDUP_DIGEST_SIZE) };
+            if (chunk.size == 0 || chunk.size > DEDUP_MAX_CHUNK)
+                return false;
+            chunks.push_back(chunk);
+            offset += chunk.size;
+
+            struct stat st;
+            bool have = (stat(chunkPath(dir, chunk.digest).c_str(), &st) == 0 && (uint64_t) st.st_size == chunk.size) ||
+                        asked.count(chunk.digest) > 0;
+            if (have)
+                continue;
+            asked.insert(chunk.digest);
+            if (!ranges.empty() && ranges.back().first + ranges.back().second == i)
+                ranges.back().second++;
+            else
+                ranges.push_back(make_pair(i, 1));
+        }
+
+        answer = formatRanges(ranges);
+        wanted.assign(count, false);
+        for (auto& range: ranges)
+            fill(wanted.begin() + range.first, wanted.begin() + range.first + range.second, true);
+
+        stats.chunks = count;
+        for (uint32_t i = 0; i < count; i++) {
+            stats.rawBytes += chunks[i].size;
+            if (wanted[i]) {
+                stats.sentChunks++;
+                stats.sentBytes += chunks[i].size;
+            }
+        }
+        manifestSize = manifestNeeded();
+        pending.erase(0, manifestSize);
+        manifestDone = true;
+        return true;
+    }
+
+    // Written under a temporary name first, so a chunk in the store is
+    // always whole.
+    bool storeChunk(const string& digest, const char* data, size_t size) {
+        string path = chunkPath(dir, digest);
+        string tmp = path + ".tmp";
+        FILE* fd = fopen(tmp.c_str(), "wb");
+        if (fd == nullptr) {
+            cerr << "Failed to store chunk " << path << endl;
+            return false;
+        }
+        bool ok = fwrite(data, 1, size, fd) == size;
+        ok = fclose(fd) == 0 && ok;
+        if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+            cerr << "Failed to store chunk " << path << endl;
+            remove(tmp.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    // A chunk that doesn't match its name is removed, so the next manifest
+    // asks for it again instead of failing on it too.
+    bool loadChunk(const chunk_t& chunk, string& out) {
+        string path = chunkPath(dir, chunk.digest);
+        FILE* fd = fopen(path.c_str(), "rb");
+        if (fd == nullptr)
+            return false;
+        out.resize(chunk.size);
+        size_t n = fread(&out[0], 1, chunk.size, fd);
+        fclose(fd);
+        if (n != chunk.size || chunkDigest(out.data(), out.size()) != chunk.digest) {
+            cerr << "Removing corrupt chunk " << path << endl;
+            remove(path.c_str());
+            return false;
+        }
+        return true;
+    }
+};
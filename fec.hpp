@@ -0,0 +1,242 @@
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "util.hpp"
+
+#pragma once
+
+using namespace std;
+
+// Forward error correction. The client follows every group of k data
+// segments with m parity packets, and the server rebuilds up to m missing
+// segments of a group from them without waiting for a retransmission. With
+// m = 1 the parity is the XOR of the segments; with more, row j is a Cauchy
+// Reed-Solomon combination over GF(256), so any k of the k + m packets are
+// enough.
+//
+// A parity packet has the P flag, the sequence number of the group's first
+// segment and a payload of: k (1), m (1), row (1), unused (1), length of the
+// group's last segment (2), then the parity bytes. Data segments are made
+// FEC_HEADER_SIZE smaller so parity packets stay within MAX_PAYLOAD_SIZE;
+// every segment of a group but the last is FEC_SEGMENT_SIZE long.
+
+const size_t FEC_HEADER_SIZE = 6;
+const size_t FEC_SEGMENT_SIZE = MAX_PAYLOAD_SIZE - FEC_HEADER_SIZE;
+const int FEC_MAX_K = 64;
+const int FEC_MAX_M = 16;
+const uint64_t FEC_HISTORY = 64 * 1024; // written bytes kept for rebuilding
+
+struct fec_header_t {
+    uint8_t k;
+    uint8_t m;
+    uint8_t row;
+    uint16_t lastSize;
+};
+
+size_t formatFecHeader(char *buf, const fec_header_t& h) {
+    buf[0] = h.k;
+    buf[1] = h.m;
+    buf[2] = h.row;
+    buf[3] = 0;
+    int2buf(buf, h.lastSize, 4, 6);
+    return FEC_HEADER_SIZE;
+}
+
+bool parseFecHeader(const char *buf, size_t size, fec_header_t& h) {
+    if (size < FEC_HEADER_SIZE)
+        return false;
+    h.k = buf[0];
+    h.m = buf[1];
+    h.row = buf[2];
+    h.lastSize = buf2int(buf, 4, 6);
+    return h.k > 0 && h.k <= FEC_MAX_K && h.m > 0 && h.m <= FEC_MAX_M && h.row < h.m &&
+           h.lastSize > 0 && h.lastSize <= FEC_SEGMENT_SIZE;
+}
+
+// GF(256) with the polynomial x^8 + x^4 + x^3 + x^2 + 1.
+struct Gf256 {
+    uint8_t exp[512];
+    uint8_t log[256];
+
+    Gf256() {
+        int x = 1;
+        for (int i = 0; i < 255; i++) {
+            exp[i] = exp[i + 255] = x;
+            log[x] = i;
+            x <<= 1;
+            if (x & 0x100)
+                x ^= 0x11d;
+        }
+        exp[510] = exp[511] = 0;
+        log[0] = 0;
+    }
+
+    uint8_t mul(uint8_t a, uint8_t b) const {
+        return a == 0 || b == 0 ? 0 : exp[log[a] + log[b]];
+    }
+
+    uint8_t inv(uint8_t a) const {
+        return exp[255 - log[a]];
+    }
+
+    static const Gf256& get() {
+        static Gf256 gf;
+        return gf;
+    }
+};
+
+// Weight of data segment col in parity row of a group.
+uint8_t fecCoefficient(int k, int m, int row, int col) {
+    return m == 1 ? 1 : Gf256::get().inv((uint8_t) ((k + row) ^ col));
+}
+
+// dst ^= c * src
+void gfAddMul(char* dst, const char* src, uint8_t c, size_t size) {
+    auto& gf = Gf256::get();
+    for (size_t i = 0; i < size; i++)
+        dst[i] ^= gf.mul(c, (uint8_t) src[i]);
+}
+
+// Computes parity row of the segments, each zero padded to size.
+string fecEncode(const vector<string>& segments, int m, int row, size_t size) {
+    string parity(size, '\0');
+    int k = segments.size();
+    for (int col = 0; col < k; col++)
+        gfAddMul(&parity[0], segments[col].data(), fecCoefficient(k, m, row, col), segments[col].size());
+    return parity;
+}
+
+// Fills in the missing segments (the indexes in missing) from the others and
+// the parity rows, which must be at least as many. Rebuilt segments are
+// parity sized; the caller cuts them to length.
+bool fecDecode(vector<string>& segments, const vector<int>& missing, int m, const map<int, string>& parity) {
+    auto& gf = Gf256::get();
+    int k = segments.size();
+    int e = missing.size();
+    if (e == 0 || (int) parity.size() < e)
+        return e == 0;
+    size_t size = parity.begin()->second.size();
+
+    // One equation per parity row used: the row minus the known segments
+    // leaves a combination of the missing ones.
+    vector<vector<uint8_t>> a(e, vector<uint8_t>(e));
+    vector<string> b;
+    auto it = parity.begin();
+    for (int r = 0; r < e; r++, ++it) {
+        if (it->second.size() != size)
+            return false;
+        b.push_back(it->second);
+        for (int col = 0; col < k; col++) {
+            if (find(missing.begin(), missing.end(), col) == missing.end())
+                gfAddMul(&b[r][0], segments[col].data(), fecCoefficient(k, m, it->first, col), min(size, segments[col].size()));
+        }
+        for (int c = 0; c < e; c++)
+            a[r][c] = fecCoefficient(k, m, it->first, missing[c]);
+    }
+
+    // Gauss-Jordan elimination, applying the same steps to the data.
+    for (int c = 0; c < e; c++) {
+        int pivot = c;
+        while (pivot < e && a[pivot][c] == 0)
+            pivot++;
+        if (pivot == e)
+            return false;
+        swap(a[pivot], a[c]);
+        swap(b[pivot], b[c]);
+
+        uint8_t scale = gf.inv(a[c][c]);
+        for (int j = 0; j < e; j++)
+            a[c][j] = gf.mul(a[c][j], scale);
+        for (size_t i = 0; i < size; i++)
+            b[c][i] = gf.mul((uint8_t) b[c][i], scale);
+
+        for (int r = 0; r < e; r++) {
+            uint8_t factor = a[r][c];
+            if (r == c || factor == 0)
+                continue;
+            for (int j = 0; j < e; j++)
+                a[r][j] ^= gf.mul(factor, a[c][j]);
+            gfAddMul(&b[r][0], b[c].data(), factor, size);
+        }
+    }
+
+    for (int c = 0; c < e; c++)
+        segments[missing[c]] = b[c];
+    return true;
+}
+
+// The server's FEC state for one connection, by position in the transfer
+// stream: recently received segments, and the groups parity arrived for.
+struct FecDecoder {
+    struct group_t {
+        fec_header_t header;
+        map<int, string> parity;
+        bool reported = false;
+        bool done = false;
+    };
+
+    map<uint64_t, string> segments;
+    map<uint64_t, group_t> groups;
+    uint32_t recovered = 0;
+
+    void addData(uint64_t pos, const string& data) {
+        segments.emplace(pos, data);
+    }
+
+    // Adds a parity packet of the group starting at base and appends the
+    // segments it allowed to rebuild to out. The first time a group is looked
+    // at, lost is set to how many of its segments were missing.
+    void addParity(uint64_t base, const fec_header_t& header, const string& parity,
+                   vector<pair<uint64_t, string>>& out, int& lost) {
+        auto& group = groups[base];
+        if (group.done)
+            return;
+        if (!group.parity.empty() && (group.header.k != header.k || group.header.m != header.m))
+            return;
+        group.header = header;
+        group.parity[header.row] = parity;
+
+        vector<string> data(header.k);
+        vector<int> missing;
+        for (int i = 0; i < header.k; i++) {
+            auto it = segments.find(base + i * FEC_SEGMENT_SIZE);
+            if (it == segments.end())
+                missing.push_back(i);
+            else
+                data[i] = it->second;
+        }
+        if (!group.reported) {
+            group.reported = true;
+            lost = missing.size();
+        }
+        if (missing.size() > group.parity.size())
+            return;
+
+        group.done = true;
+        if (missing.empty() || !fecDecode(data, missing, header.m, group.parity))
+            return;
+        for (int i: missing) {
+            size_t size = i == header.k - 1 ? header.lastSize : FEC_SEGMENT_SIZE;
+            if (data[i].size() < size)
+                return;
+            data[i].resize(size);
+            uint64_t pos = base + i * FEC_SEGMENT_SIZE;
+            segments.emplace(pos, data[i]);
+            out.push_back(make_pair(pos, data[i]));
+            recovered++;
+        }
+    }
+
+    // Forgets what lies well before the first byte not yet written.
+    void trim(uint64_t written) {
+        if (written <= FEC_HISTORY)
+            return;
+        uint64_t keep = written - FEC_HISTORY;
+        segments.erase(segments.begin(), segments.lower_bound(keep));
+        groups.erase(groups.begin(), groups.lower_bound(keep));
+    }
+};
@@ -0,0 +1,61 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <chrono>
+
+#pragma once
+
+using namespace std;
+
+// The protocol state machines (see sender.hpp and receiver.hpp) never touch
+// sockets or the system clock themselves. They are handed a clock to read and
+// a way to send packets, so the same code runs over UDP in client and server
+// and over simulated links in virtual time in sim.
+
+typedef chrono::steady_clock::time_point timestamp_t;
+
+class Clock {
+public:
+    virtual ~Clock() {}
+    virtual timestamp_t now() = 0;
+};
+
+class PacketIO {
+public:
+    virtual ~PacketIO() {}
+    virtual void send(const char* packet, size_t size, const sockaddr& to) = 0;
+};
+
+class SystemClock : public Clock {
+public:
+    timestamp_t now() override {
+        return chrono::steady_clock::now();
+    }
+};
+
+class UdpSocket : public PacketIO {
+public:
+    explicit UdpSocket(int fd): fd(fd) {}
+
+    void send(const char* packet, size_t size, const sockaddr& to) override {
+        if (sendto(fd, packet, size, 0, &to, sizeof to) < 0)
+            perror("sendto failed");
+    }
+
+private:
+    int fd;
+};
+
+double millisBetween(timestamp_t from, timestamp_t to) {
+    return chrono::duration<double, milli>(to - from).count();
+}
+
+// Rounded up to the clock's resolution, so that millisBetween(from, result)
+// is at least ms. A deadline that falls short would have the timer it is
+// for not expire yet when it is reached.
+timestamp_t afterMillis(timestamp_t from, double ms) {
+    auto after = chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double, milli>(ms));
+    while (chrono::duration<double, milli>(after).count() < ms)
+        after += chrono::steady_clock::duration(1);
+    return from + after;
+}
@@ -0,0 +1,437 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <queue>
+#include <random>
+#include <memory>
+#include <algorithm>
+#include <unordered_map>
+#include <chrono>
+#include <cstring>
+#include <cmath>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+
+#include "io.hpp"
+#include "protocol.hpp"
+#include "sender.hpp"
+#include "udpstats.hpp"
+
+using namespace std;
+
+// Load generator: runs many concurrent transfers against a server from one
+// process and a few sockets, each transfer driven by its own Sender. Sessions
+// on the same socket get different ISNs, so SYN-ACKs are matched to their
+// session by the ISN they acknowledge, and everything after by connection ID.
+
+struct load_config_t {
+    int sessions = 1000;
+    int concurrency = 100;     // sessions handshaking or sending at once
+    double arrivalRate = 0;    // sessions started per second, 0 = as fast as concurrency allows
+    int sockets = 4;
+    string sizes = "10000";
+    uint64_t seed = 1;
+    // A server on this host started with --stats FILE, to report its own drops
+    string serverStats;
+    pid_t serverPid = 0;
+};
+
+// File sizes: N, MIN-MAX (uniform), exp:MEAN or pareto:MIN:ALPHA. Sizes are
+// capped at 100 MB.
+class SizeDistribution {
+public:
+    explicit SizeDistribution(const string& spec) {
+        auto colon = spec.find(':');
+        kind = colon == string::npos ? "" : spec.substr(0, colon);
+        string rest = colon == string::npos ? spec : spec.substr(colon + 1);
+        if (kind.empty()) {
+            auto dash = rest.find('-');
+            a = stod(rest.substr(0, dash));
+            b = dash == string::npos ? a : stod(rest.substr(dash + 1));
+            kind = "uniform";
+        } else if (kind == "exp") {
+            a = stod(rest);
+        } else if (kind == "pareto") {
+            auto sep = rest.find(':');
+            a = stod(rest.substr(0, sep));
+            b = sep == string::npos ? 1.5 : stod(rest.substr(sep + 1));
+        } else {
+            throw invalid_argument(spec);
+        }
+        if (a < 0 || b < 0 || (kind == "uniform" && a > b) || (kind == "pareto" && b <= 0))
+            throw invalid_argument(spec);
+    }
+
+    uint32_t operator()(mt19937_64& rng) const {
+        double size;
+        if (kind == "uniform")
+            size = uniform_real_distribution<double>(a, b)(rng);
+        else if (kind == "exp")
+            size = exponential_distribution<double>(1 / max(a, 1.0))(rng);
+        else
+            size = a / pow(1 - uniform_real_distribution<double>(0, 1)(rng), 1 / b);
+        return (uint32_t) min(size, 100.0 * 1024 * 1024);
+    }
+
+private:
+    string kind;
+    double a = 0, b = 0;
+};
+
+double percentile(const vector<double>& sorted, double p) {
+    if (sorted.empty())
+        return 0;
+    return sorted[min(sorted.size() - 1, (size_t) (p * sorted.size()))];
+}
+
+class LoadGenerator {
+public:
+    LoadGenerator(const load_config_t& cfg, const sockaddr& server):
+        cfg(cfg), server(server), rng(cfg.seed), sizes(cfg.sizes) {
+        for (int i = 0; i < cfg.sockets; i++) {
+            int fd = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
+            if (fd < 0) {
+                perror("Failed to create socket.");
+                exit(1);
+            }
+            // A few sockets carry the ACKs of many windows.
+            int size = 4 << 20;
+            setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof size);
+            sockets.emplace_back(new socket_t(fd));
+        }
+        sessions.resize(cfg.sessions);
+    }
+
+    void run() {
+        auto counters = readUdpCounters();
+        server_stats_t serverBefore, serverAfter;
+        bool serverKnown = cfg.serverPid != 0 && snapshotServer(serverBefore);
+        startTime = clock.now();
+        auto nextArrival = startTime;
+        exponential_distribution<double> gaps(cfg.arrivalRate > 0 ? cfg.arrivalRate : 1);
+
+        while (launched < sessions.size() || running > 0) {
+            auto now = clock.now();
+
+            while (launched < sessions.size() && open < (size_t) cfg.concurrency && nextArrival <= now) {
+                launch(launched++);
+                if (cfg.arrivalRate > 0)
+                    nextArrival = afterMillis(nextArrival, gaps(rng) * 1000);
+            }
+
+            for (auto& sock: sockets)
+                receive(*sock);
+
+            now = clock.now();
+            while (!timers.empty() && timers.top().first <= now) {
+                auto timer = timers.top();
+                timers.pop();
+                auto& session = sessions[timer.second];
+                if (timer.first != session.timer || session.sender == nullptr)
+                    continue;
+                session.timer = timestamp_t::max();
+                session.sender->poll();
+                update(timer.second);
+            }
+
+            wait(launched < sessions.size() && open < (size_t) cfg.concurrency ? nextArrival : timestamp_t::max());
+        }
+
+        auto after = readUdpCounters();
+        drops.inErrors = after.inErrors - counters.inErrors;
+        drops.rcvbufErrors = after.rcvbufErrors - counters.rcvbufErrors;
+        if (serverKnown && snapshotServer(serverAfter)) {
+            serverDrops.drops = serverAfter.drops - serverBefore.drops;
+            serverDrops.socketDrops = serverAfter.socketDrops - serverBefore.socketDrops;
+            serverMeasured = true;
+        } else if (cfg.serverPid != 0) {
+            cerr << "No stats from the server in " << cfg.serverStats << endl;
+        }
+    }
+
+    int report() {
+        size_t completed = 0, failed = 0;
+        uint64_t bytes = 0;
+        uint32_t timeouts = 0;
+        timestamp_t lastHandshake = startTime, lastFinish = startTime;
+        vector<double> handshakeTimes, completionTimes;
+        for (auto& session: sessions) {
+            timeouts += session.timeouts;
+            if (session.established) {
+                handshakeTimes.push_back(millisBetween(session.start, session.handshake));
+                lastHandshake = max(lastHandshake, session.handshake);
+            }
+            if (!session.finished) {
+                failed++;
+                continue;
+            }
+            completed++;
+            bytes += session.size;
+            completionTimes.push_back(millisBetween(session.start, session.finish));
+            lastFinish = max(lastFinish, session.finish);
+        }
+        sort(handshakeTimes.begin(), handshakeTimes.end());
+        sort(completionTimes.begin(), completionTimes.end());
+        double handshakeSeconds = millisBetween(startTime, lastHandshake) / 1000;
+        double seconds = millisBetween(startTime, lastFinish) / 1000;
+
+        cout << "sessions     " << sessions.size() << " (" << completed << " completed, " << failed << " failed) over "
+             << sockets.size() << " sockets, " << seconds << " s" << endl;
+        cout << "handshakes   " << (handshakeSeconds > 0 ? handshakeTimes.size() / handshakeSeconds : 0) << "/s, p50 "
+             << percentile(handshakeTimes, 0.5) << " ms, p99 " << percentile(handshakeTimes, 0.99) << " ms" << endl;
+        cout << "goodput      " << (seconds > 0 ? bytes * 8 / seconds / 1e6 : 0) << " Mbit/s (" << bytes << " bytes)" << endl;
+        cout << "completion   p50 " << percentile(completionTimes, 0.5) << " ms, p99 " << percentile(completionTimes, 0.99)
+             << " ms, p999 " << percentile(completionTimes, 0.999) << " ms" << endl;
+        cout << "timeouts     " << timeouts << " retransmission timeouts" << endl;
+        cout << "udp drops    " << drops.rcvbufErrors << " receive buffer overflows, " << drops.inErrors
+             << " receive errors (host-wide, includes the server if it runs here)" << endl;
+        if (serverMeasured)
+            cout << "server drops " << serverDrops.socketDrops << " receive buffer overflows at its socket, " << serverDrops.drops
+                 << " packets for no open connection" << endl;
+        return failed == 0 ? 0 : 1;
+    }
+
+private:
+    struct socket_t {
+        int fd;
+        UdpSocket io;
+        // Sessions waiting for a SYN-ACK by ISN, and the others by connection ID
+        unordered_map<uint32_t, size_t> byIsn;
+        unordered_map<uint16_t, size_t> byCid;
+        uint32_t nextIsn = 12345;
+
+        explicit socket_t(int fd): fd(fd), io(fd) {}
+    };
+
+    struct session_t {
+        unique_ptr<SyntheticSource> source;
+        unique_ptr<Sender> sender;
+        socket_t* sock = nullptr;
+        uint32_t isn = 0;
+        uint32_t size = 0;
+        timestamp_t start, handshake, finish;
+        timestamp_t timer = timestamp_t::max();
+        bool established = false;
+        bool finished = false; // everything acknowledged
+        bool counted = false;  // no longer counts against the concurrency
+        uint32_t timeouts = 0;
+    };
+
+    load_config_t cfg;
+    sockaddr server;
+    mt19937_64 rng;
+    SizeDistribution sizes;
+    SystemClock clock;
+    vector<unique_ptr<socket_t>> sockets;
+    vector<session_t> sessions;
+    size_t launched = 0;
+    size_t open = 0;    // handshaking or sending
+    size_t running = 0; // not done yet, including the FIN wait
+    timestamp_t startTime;
+    udp_counters_t drops;
+    server_stats_t serverDrops;
+    bool serverMeasured = false;
+
+    priority_queue<pair<timestamp_t, size_t>, vector<pair<timestamp_t, size_t>>, greater<pair<timestamp_t, size_t>>> timers;
+
+    void launch(size_t id) {
+        auto& session = sessions[id];
+        session.sock = sockets[id % sockets.size()].get();
+
+        // Skip ISNs still waiting for their SYN-ACK, so every SYN on a socket
+        // is different.
+        auto& sock = *session.sock;
+        do {
+            sock.nextIsn = (sock.nextIsn + 1) % (MAX_SEQ_NUM - 1);
+        } while (sock.byIsn.count(sock.nextIsn));
+        session.isn = sock.nextIsn;
+        sock.byIsn[session.isn] = id;
+
+        session.size = sizes(rng);
+        session.source.reset(new SyntheticSource(session.size, cfg.seed * 1000003 + id));
+        sender_config_t scfg;
+        scfg.wanted.fileSize = session.size;
+        scfg.negotiate = true;
+        scfg.log = false;
+        scfg.isn = session.isn;
+        session.sender.reset(new Sender(clock, sock.io, server, *session.source, nullptr, scfg));
+
+        open++;
+        running++;
+        session.start = clock.now();
+        session.sender->start();
+        update(id);
+    }
+
+    void receive(socket_t& sock) {
+        char buffer[MAX_PACKET_SIZE];
+        // Bounded, so one busy socket doesn't starve the timers.
+        for (int i = 0; i < 256; i++) {
+            ssize_t size = recv(sock.fd, buffer, sizeof buffer, MSG_DONTWAIT);
+            if (size < 12)
+                return;
+            auto at = clock.now();
+            auto header = getHeader(buffer, size);
+
+            size_t id;
+            auto byCid = sock.byCid.find(header.cid);
+            auto byIsn = sock.byIsn.find(header.ack - 1);
+            if (header.s && byIsn != sock.byIsn.end())
+                id = byIsn->second;
+            else if (byCid != sock.byCid.end())
+                id = byCid->second;
+            else
+                continue;
+
+            sessions[id].sender->onPacket(header, getPayload(buffer, size), at);
+            sessions[id].sender->poll();
+            update(id);
+        }
+    }
+
+    // Notes progress, releases finished sessions and makes sure the rest are
+    // polled by their deadline.
+    void update(size_t id) {
+        auto& session = sessions[id];
+        auto& sender = *session.sender;
+        auto state = sender.state();
+        auto now = clock.now();
+
+        if (!session.established && state != SenderState::SYN_SENT && state != SenderState::ABORTED) {
+            session.established = true;
+            session.handshake = now;
+            session.sock->byIsn.erase(session.isn);
+            session.sock->byCid[sender.connectionId()] = id;
+        }
+        if (!session.finished && (state == SenderState::CLOSING || state == SenderState::CLOSED)) {
+            session.finished = true;
+            session.finish = now;
+        }
+        if (!session.counted && state != SenderState::SYN_SENT && state != SenderState::ESTABLISHED) {
+            session.counted = true;
+            open--;
+        }
+
+        if (sender.done()) {
+            auto& sock = *session.sock;
+            if (!session.established)
+                sock.byIsn.erase(session.isn);
+            else if (sock.byCid[sender.connectionId()] == id)
+                sock.byCid.erase(sender.connectionId());
+            session.timeouts = sender.timeouts();
+            session.sender.reset();
+            session.source.reset();
+            running--;
+            return;
+        }
+
+        auto deadline = sender.deadline();
+        if (deadline < session.timer) {
+            session.timer = deadline;
+            timers.push(make_pair(deadline, id));
+        }
+    }
+
+    // Asks the server for its stats file with SIGUSR1 and reads it once the
+    // server has written it, which it does within a receive timeout.
+    bool snapshotServer(server_stats_t& stats) {
+        remove(cfg.serverStats.c_str());
+        if (kill(cfg.serverPid, SIGUSR1) != 0)
+            return false;
+        for (int i = 0; i < 200; i++) {
+            if (readServerStats(cfg.serverStats, stats))
+                return true;
+            usleep(10000);
+        }
+        return false;
+    }
+
+    // Sleeps until a packet arrives, a timer is due or until, whichever is first.
+    void wait(timestamp_t until) {
+        if (!timers.empty())
+            until = min(until, timers.top().first);
+        auto now = clock.now();
+        int timeout = until <= now ? 0 : (int) min(millisBetween(now, until), 10.0);
+
+        vector<struct pollfd> fds;
+        for (auto& sock: sockets)
+            fds.push_back(pollfd { sock->fd, POLLIN, 0 });
+        ::poll(fds.data(), fds.size(), timeout);
+    }
+};
+
+int main(int argc, const char * argv[]) {
+    if (argc < 3) {
+        std::cerr << "ERROR: Invalid number of arguments. Need IP address and port number of the server." << endl;
+        exit(1);
+    }
+
+    load_config_t cfg;
+    for (int i = 3; i < argc; i++) {
+        string flag(argv[i]);
+        if (i + 1 >= argc) {
+            std::cerr << "ERROR: Missing value for " << flag << endl;
+            exit(1);
+        }
+        string value(argv[++i]);
+        try {
+            if (flag == "--sessions") {
+                cfg.sessions = stoi(value);
+            } else if (flag == "--concurrency") {
+                cfg.concurrency = stoi(value);
+            } else if (flag == "--arrival-rate") {
+                cfg.arrivalRate = stod(value);
+            } else if (flag == "--sockets") {
+                cfg.sockets = stoi(value);
+            } else if (flag == "--size") {
+                cfg.sizes = value;
+                SizeDistribution check(value);
+            } else if (flag == "--seed") {
+                cfg.seed = stoull(value);
+            } else if (flag == "--server-stats") {
+                cfg.serverStats = value;
+            } else if (flag == "--server-pid") {
+                cfg.serverPid = stoi(value);
+            } else {
+                std::cerr << "ERROR: Unknown option " << flag << endl;
+                exit(1);
+            }
+        } catch (std::exception const &e) {
+            std::cerr << "ERROR: Invalid value for " << flag << ": " << value << endl;
+            exit(1);
+        }
+    }
+    if (cfg.serverStats.empty() != (cfg.serverPid == 0)) {
+        std::cerr << "ERROR: --server-stats and --server-pid go together." << endl;
+        exit(1);
+    }
+    if (cfg.sessions <= 0 || cfg.concurrency <= 0 || cfg.sockets <= 0) {
+        std::cerr << "ERROR: Sessions, concurrency and sockets need to be positive." << endl;
+        exit(1);
+    }
+
+    struct addrinfo hints;
+    struct addrinfo *res;
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    auto ret = getaddrinfo(argv[1], argv[2], &hints, &res);
+    if (ret != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(ret));
+        exit(EXIT_FAILURE);
+    }
+    sockaddr server = *res->ai_addr;
+    freeaddrinfo(res);
+
+    LoadGenerator load(cfg, server);
+    load.run();
+    return load.report();
+}
@@ -0,0 +1,149 @@
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#pragma once
+
+using namespace std;
+
+// Small LZ77 codec in the spirit of LZ4: greedy matching through a hash table
+// of 4-byte sequences, byte-aligned output, no entropy coding. It is fast
+// enough to keep up with the sender and needs nothing outside this repo.
+//
+// A compressed block is a list of sequences:
+//   token (literal length << 4 | match length - 4), [literal length ext],
+//   literals, offset (2 bytes LE), [match length ext]
+// Lengths of 15 are extended by bytes of 255 ended by a byte < 255. The last
+// sequence only has literals and ends the block.
+
+const int LZ_HASH_BITS = 14;
+const size_t LZ_MIN_MATCH = 4;
+const size_t LZ_LAST_LITERALS = 5;
+const size_t LZ_MAX_OFFSET = 65535;
+
+static inline uint32_t lzRead32(const unsigned char *p) {
+    uint32_t val;
+    memcpy(&val, p, sizeof val);
+    return val;
+}
+
+static inline uint32_t lzHash(uint32_t val) {
+    return (val * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static void lzWriteLength(string& out, size_t len) {
+    while (len >= 255) {
+        out.push_back((char) 255);
+        len -= 255;
+    }
+    out.push_back((char) len);
+}
+
+static bool lzReadLength(const unsigned char *in, size_t size, size_t& pos, size_t& len) {
+    unsigned char cur;
+    do {
+        if (pos >= size)
+            return false;
+        cur = in[pos++];
+        len += cur;
+    } while (cur == 255);
+    return true;
+}
+
+// Emits one sequence. A zero match length marks the final literal run.
+static void lzEmit(string& out, const unsigned char *lit, size_t litLen, size_t offset, size_t matchLen) {
+    size_t extra = matchLen ? matchLen - LZ_MIN_MATCH : 0;
+    unsigned char token = (unsigned char) ((min(litLen, (size_t) 15) << 4) | min(extra, (size_t) 15));
+    out.push_back((char) token);
+    if (litLen >= 15)
+        lzWriteLength(out, litLen - 15);
+    out.append((const char *) lit, litLen);
+
+    if (matchLen == 0)
+        return;
+    out.push_back((char) (offset & 0xff));
+    out.push_back((char) (offset >> 8));
+    if (extra >= 15)
+        lzWriteLength(out, extra - 15);
+}
+
+// Appends the compressed form of src to out and returns its size.
+size_t lzCompress(const char *src, size_t size, string& out) {
+    const unsigned char *in = (const unsigned char *) src;
+    size_t start = out.size();
+    size_t anchor = 0;
+
+    if (size >= LZ_MIN_MATCH + LZ_LAST_LITERALS) {
+        vector<uint32_t> table(1 << LZ_HASH_BITS, 0);
+        size_t limit = size - LZ_LAST_LITERALS;
+        size_t i = 0;
+
+        while (i + LZ_MIN_MATCH <= limit) {
+            uint32_t cur = lzRead32(in + i);
+            uint32_t h = lzHash(cur);
+            size_t cand = table[h];
+            table[h] = (uint32_t) i;
+
+            if (cand < i && i - cand <= LZ_MAX_OFFSET && lzRead32(in + cand) == cur) {
+                size_t len = LZ_MIN_MATCH;
+                while (i + len < limit && in[cand + len] == in[i + len])
+                    len++;
+                lzEmit(out, in + anchor, i - anchor, i - cand, len);
+                i += len;
+                anchor = i;
+            } else {
+                i++;
+            }
+        }
+    }
+
+    lzEmit(out, in + anchor, size - anchor, 0, 0);
+    return out.size() - start;
+}
+
+// Decodes a block produced by lzCompress into dst, which must hold exactly
+// rawSize bytes. Returns false if the block is corrupt.
+bool lzDecompress(const char *src, size_t size, char *dst, size_t rawSize) {
+    const unsigned char *in = (const unsigned char *) src;
+    size_t ip = 0, op = 0;
+
+    while (ip < size) {
+        unsigned char token = in[ip++];
+
+        size_t lit = token >> 4;
+        if (lit == 15 && !lzReadLength(in, size, ip, lit))
+            return false;
+        if (lit > size - ip || lit > rawSize - op)
+            return false;
+        memcpy(dst + op, in + ip, lit);
+        ip += lit;
+        op += lit;
+
+        // Final sequence carries literals only.
+        if (ip == size)
+            break;
+
+        if (size - ip < 2)
+            return false;
+        size_t offset = in[ip] | (in[ip + 1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > op)
+            return false;
+
+        size_t len = token & 15;
+        if (len == 15 && !lzReadLength(in, size, ip, len))
+            return false;
+        len += LZ_MIN_MATCH;
+        if (len > rawSize - op)
+            return false;
+
+        // Matches may overlap their own output, so copy byte by byte.
+        for (size_t k = 0; k < len; k++)
+            dst[op + k] = dst[op - offset + k];
+        op += len;
+    }
+
+    return op == rawSize;
+}
@@ -0,0 +1,170 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#pragma once
+
+using namespace std;
+
+// Reads the UDP datagrams of a classic pcap file (not pcapng), as written by
+// tcpdump and Wireshark. Handles either byte order, microsecond and
+// nanosecond timestamps, and captures from loopback, Ethernet, Linux cooked
+// and raw IP interfaces. Only unfragmented IPv4 is understood.
+
+struct datagram_t {
+    double time;  // seconds since the first datagram of the capture
+    uint32_t srcAddr, dstAddr; // host byte order
+    uint16_t srcPort, dstPort;
+    string payload;
+};
+
+struct pcap_stats_t {
+    uint64_t packets = 0;
+    uint64_t skipped = 0;   // not UDP over IPv4, fragmented or truncated
+};
+
+#define LINKTYPE_NULL 0
+#define LINKTYPE_ETHERNET 1
+#define LINKTYPE_RAW 101
+#define LINKTYPE_LOOP 108
+#define LINKTYPE_LINUX_SLL 113
+#define LINKTYPE_LINUX_SLL2 276
+
+uint32_t pcapGet32(const unsigned char* p, bool swapped) {
+    if (swapped)
+        return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+    return (uint32_t) p[3] << 24 | (uint32_t) p[2] << 16 | (uint32_t) p[1] << 8 | p[0];
+}
+
+uint16_t netGet16(const unsigned char* p) {
+    return (uint16_t) (p[0] << 8 | p[1]);
+}
+
+uint32_t netGet32(const unsigned char* p) {
+    return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+}
+
+// Where the IPv4 header starts in a frame of the link type, or -1 if the
+// frame doesn't carry IPv4.
+long ipOffset(uint32_t linkType, const unsigned char* frame, size_t size) {
+    switch (linkType) {
+        case LINKTYPE_NULL:
+            // Address family in the byte order of the capturing host
+            if (size < 4 || (pcapGet32(frame, false) != 2 && pcapGet32(frame, true) != 2))
+                return -1;
+            return 4;
+        case LINKTYPE_LOOP:
+            return size >= 4 && netGet32(frame) == 2 ? 4 : -1;
+        case LINKTYPE_ETHERNET: {
+            size_t at = 12;
+            while (size >= at + 2 && (netGet16(frame + at) == 0x8100 || netGet16(frame + at) == 0x88a8))
+                at += 4; // VLAN tags
+            return size >= at + 2 && netGet16(frame + at) == 0x0800 ? at + 2 : -1;
+        }
+        case LINKTYPE_RAW:
+        case 12:
+        case 14:
+            return 0;
+        case LINKTYPE_LINUX_SLL:
+            return size >= 16 && netGet16(frame + 14) == 0x0800 ? 16 : -1;
+        case LINKTYPE_LINUX_SLL2:
+            return size >= 20 && netGet16(frame) == 0x0800 ? 20 : -1;
+        default:
+            return -1;
+    }
+}
+
+// Fills in out from the UDP datagram in frame. Returns false if there is
+// none.
+bool parseFrame(uint32_t linkType, const unsigned char* frame, size_t size, datagram_t& out) {
+    long at = ipOffset(linkType, frame, size);
+    if (at < 0 || size < (size_t) at + 20)
+        return false;
+    const unsigned char* ip = frame + at;
+    size -= at;
+
+    size_t ihl = (ip[0] & 0x0f) * 4;
+    size_t total = netGet16(ip + 2);
+    if ((ip[0] >> 4) != 4 || ihl < 20 || ip[9] != 17 || total < ihl + 8 || size < ihl + 8)
+        return false;
+    // More fragments, or not the first fragment
+    if ((netGet16(ip + 6) & 0x3fff) != 0)
+        return false;
+
+    const unsigned char* udp = ip + ihl;
+    size_t udpSize = netGet16(udp + 4);
+    if (udpSize < 8 || ihl + udpSize > total || size < ihl + udpSize)
+        return false;
+
+    out.srcAddr = netGet32(ip + 12);
+    out.dstAddr = netGet32(ip + 16);
+    out.srcPort = netGet16(udp);
+    out.dstPort = netGet16(udp + 2);
+    out.payload.assign((const char*) udp + 8, udpSize - 8);
+    return true;
+}
+
+// Reads the UDP datagrams in the capture at path into out. Returns false and
+// sets error if the file can't be read.
+bool readPcap(const string& path, vector<datagram_t>& out, pcap_stats_t& stats, string& error) {
+    FILE* fd = fopen(path.c_str(), "rb");
+    if (fd == nullptr) {
+        error = "can't open " + path;
+        return false;
+    }
+
+    unsigned char header[24];
+    if (fread(header, 1, sizeof header, fd) != sizeof header) {
+        fclose(fd);
+        error = path + " is too short for a pcap file";
+        return false;
+    }
+
+    uint32_t magic = pcapGet32(header, false);
+    bool swapped, nanos;
+    if (magic == 0xa1b2c3d4 || magic == 0xa1b23c4d) {
+        swapped = false;
+        nanos = magic == 0xa1b23c4d;
+    } else if (magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1) {
+        swapped = true;
+        nanos = magic == 0x4d3cb2a1;
+    } else {
+        fclose(fd);
+        error = magic == 0x0a0d0d0a ? path + " is pcapng, convert it with editcap -F pcap" : path + " is not a pcap file";
+        return false;
+    }
+    uint32_t linkType = pcapGet32(header + 20, swapped) & 0x0fffffff;
+
+    unsigned char record[16];
+    vector<unsigned char> frame;
+    double first = -1;
+    while (fread(record, 1, sizeof record, fd) == sizeof record) {
+        uint32_t seconds = pcapGet32(record, swapped);
+        uint32_t fraction = pcapGet32(record + 4, swapped);
+        uint32_t captured = pcapGet32(record + 8, swapped);
+        // A cut off capture still has its packets up to there.
+        frame.resize(min(captured, (uint32_t) 1 << 24));
+        if (captured > frame.size() || fread(frame.data(), 1, captured, fd) != captured) {
+            cerr << "WARNING: " << path << " ends with a corrupt or partial packet" << endl;
+            break;
+        }
+        stats.packets++;
+
+        datagram_t datagram;
+        if (!parseFrame(linkType, frame.data(), captured, datagram)) {
+            stats.skipped++;
+            continue;
+        }
+        double time = seconds + fraction / (nanos ? 1e9 : 1e6);
+        if (first < 0)
+            first = time;
+        datagram.time = time - first;
+        out.push_back(datagram);
+    }
+    fclose(fd);
+    return true;
+}
@@ -10,12 +10,33 @@ struct header_t {
     uint32_t ack;
     uint16_t cid;
     bool a,s,f;
+    // Payload starts with an option block (see formatOptions). Only set on
+    // negotiating packets, so plain clients and servers never see it.
+    bool o;
+    // Parity packet of a forward error correction group (see fec.hpp)
+    bool p;
 };
 
+#define MASK_P 0b10000
+#define MASK_O 0b1000
 #define MASK_A 0b100
 #define MASK_S 0b010
 #define MASK_F 0b001
 
+// Option kinds carried in an option block.
+#define OPT_COMPRESS 1
+#define OPT_RESUME_TOKEN 2
+#define OPT_RESUME_OFFSET 3
+#define OPT_FILE_SIZE 4
+#define OPT_COOKIE 5
+#define OPT_FEC 6
+#define OPT_DEDUP 7
+#define OPT_MISSING_CHUNKS 8
+
+// Room for the longest option block either side sends, every option set and
+// the missing chunk ranges at their 255 byte limit.
+#define MAX_OPTIONS_SIZE 320
+
 header_t getHeader(char* buf, ssize_t size) {
     auto flags = (uint16_t) buf2int(buf, 10, 12);
     header_t h { 
@@ -25,6 +46,8 @@ header_t getHeader(char* buf, ssize_t size) {
         (bool) (flags & MASK_A),
         (bool) (flags & MASK_S),
         (bool) (flags & MASK_F),
+        (bool) (flags & MASK_O),
+        (bool) (flags & MASK_P),
     };
     // debug
     // cout << "Recv'd packet" << endl;
@@ -92,10 +115,144 @@ size_t formatSendPacket(char *buf, header_t header, const char* payload, ssize_t
     int2buf(buf, header.seq, 0, 4);
     int2buf(buf, header.ack, 4, 8);
     int2buf(buf, header.cid, 8, 10);
-    buf[11] = MASK_A * header.a + MASK_S * header.s + MASK_F * header.f;
+    buf[10] = 0;
+    buf[11] = MASK_P * header.p + MASK_O * header.o + MASK_A * header.a + MASK_S * header.s + MASK_F * header.f;
     
     if (payload != nullptr && payloadSize != 0)
         memcpy(buf + 12, payload, payloadSize);
 
     return payloadSize + 12;
-}
\ No newline at end of file
+}
+
+// Transfer options negotiated during the handshake. The client puts the ones
+// it wants in the SYN, the server answers with the ones it accepted.
+struct options_t {
+    bool compress = false;
+    // Client: identifies the transfer so it can be resumed (0 = not resumable)
+    uint64_t resumeToken = 0;
+    // Server: the transfer is resumable and continues from resumeOffset
+    bool resumed = false;
+    uint32_t resumeOffset = 0;
+    // Client: size of the file being sent, so the server can preallocate it
+    uint32_t fileSize = 0;
+    // Server: the SYN-ACK carries a SYN cookie, echo the options in the ACK
+    bool cookie = false;
+    // Forward error correction: up to fecM parity packets per fecK data
+    // segments (0 = off)
+    uint8_t fecK = 0;
+    uint8_t fecM = 0;
+    // The stream is a chunk manifest and chunks (see dedup.hpp)
+    bool dedup = false;
+    // Server: the ranges of chunks it needs, sent in ACKs once the manifest
+    // is in
+    bool answered = false;
+    string missingChunks;
+};
+
+// Option block layout: 2 bytes total length, then (kind, length, value)
+// triples. Unknown kinds are skipped so either side can be older.
+size_t formatOptions(char *buf, const options_t& opts) {
+    size_t pos = 2;
+    if (opts.compress) {
+        buf[pos++] = OPT_COMPRESS;
+        buf[pos++] = 0;
+    }
+    if (opts.resumeToken != 0) {
+        buf[pos++] = OPT_RESUME_TOKEN;
+        buf[pos++] = 8;
+        int2buf(buf + pos, opts.resumeToken >> 32, 0, 4);
+        int2buf(buf + pos, opts.resumeToken & 0xffffffff, 4, 8);
+        pos += 8;
+    }
+    if (opts.resumed) {
+        buf[pos++] = OPT_RESUME_OFFSET;
+        buf[pos++] = 4;
+        int2buf(buf + pos, opts.resumeOffset, 0, 4);
+        pos += 4;
+    }
+    if (opts.cookie) {
+        buf[pos++] = OPT_COOKIE;
+        buf[pos++] = 0;
+    }
+    if (opts.fecK != 0) {
+        buf[pos++] = OPT_FEC;
+        buf[pos++] = 2;
+        buf[pos++] = opts.fecK;
+        buf[pos++] = opts.fecM;
+    }
+    if (opts.dedup) {
+        buf[pos++] = OPT_DEDUP;
+        buf[pos++] = 0;
+    }
+    if (opts.answered) {
+        buf[pos++] = OPT_MISSING_CHUNKS;
+        buf[pos++] = opts.missingChunks.size();
+        memcpy(buf + pos, opts.missingChunks.data(), opts.missingChunks.size());
+        pos += opts.missingChunks.size();
+    }
+    if (opts.fileSize != 0) {
+        buf[pos++] = OPT_FILE_SIZE;
+        buf[pos++] = 4;
+        int2buf(buf + pos, opts.fileSize, 0, 4);
+        pos += 4;
+    }
+    int2buf(buf, pos, 0, 2);
+    return pos;
+}
+
+// Returns the size of the option block, or 0 if it is malformed.
+size_t parseOptions(const char *buf, size_t size, options_t& opts) {
+    if (size < 2)
+        return 0;
+    size_t total = buf2int(buf, 0, 2);
+    if (total < 2 || total > size)
+        return 0;
+
+    size_t pos = 2;
+    while (pos + 2 <= total) {
+        uint8_t kind = buf[pos];
+        size_t len = (uint8_t) buf[pos + 1];
+        pos += 2;
+        if (pos + len > total)
+            return 0;
+        switch (kind) {
+            case OPT_COMPRESS:
+                opts.compress = true;
+                break;
+            case OPT_RESUME_TOKEN:
+                if (len == 8)
+                    opts.resumeToken = ((uint64_t) buf2int(buf + pos, 0, 4) << 32) | buf2int(buf + pos, 4, 8);
+                break;
+            case OPT_RESUME_OFFSET:
+                if (len == 4) {
+                    opts.resumed = true;
+                    opts.resumeOffset = buf2int(buf + pos, 0, 4);
+                }
+                break;
+            case OPT_COOKIE:
+                opts.cookie = true;
+                break;
+            case OPT_FEC:
+                if (len == 2) {
+                    opts.fecK = buf[pos];
+                    opts.fecM = buf[pos + 1];
+                }
+                break;
+            case OPT_DEDUP:
+                opts.dedup = true;
+                break;
+            case OPT_MISSING_CHUNKS:
+                opts.answered = true;
+                opts.missingChunks = string(buf + pos, len);
+                break;
+            case OPT_FILE_SIZE:
+                if (len == 4)
+                    opts.fileSize = buf2int(buf + pos, 0, 4);
+                break;
+            default:
+                break;
+        }
+        pos += len;
+    }
+    return total;
+}
@@ -0,0 +1,793 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <iostream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+#include "io.hpp"
+#include "protocol.hpp"
+#include "connection.hpp"
+#include "syncookie.hpp"
+#include "tuning.hpp"
+
+#pragma once
+
+using namespace std;
+
+// The server side of the protocol: handshakes, in-order writing of the data
+// of every connection, ACKs, FINs and timeouts. Packets go out through io and
+// time comes from clock; received packets are fed in with onPacket, and tick
+// has to be called regularly to expire idle connections.
+class Receiver {
+public:
+    // Write received files with O_DIRECT instead of through the page cache
+    bool directIO = false;
+    // Keep no state for a SYN until the client answers the SYN-ACK
+    bool synCookies = false;
+    // Print the packet log to stdout and notes to stderr
+    bool log = true;
+    // The idle timeout and how far ahead of the stream data is queued
+    tuning_t tuning;
+    // Makes the storage each received file is written through
+    function<unique_ptr<Storage>()> storageFactory;
+
+    // Packets dropped for belonging to no open connection
+    uint64_t drops = 0;
+
+    Receiver(Clock& clock, PacketIO& io, const string& saveDir):
+        clock(clock), io(io), saveDir(saveDir), lastSweep(clock.now()) {
+        storageFactory = [this]() { return makeStorage(directIO); };
+    }
+
+    void onPacket(const char* buffer, size_t size, const sockaddr& sender) {
+        if (size < 12)
+            return;
+        auto header = getHeader((char*) buffer, size);
+        auto payload = getPayload((char*) buffer, size);
+        auto now = clock.now();
+
+        // Packets only count for a connection if they come from its client.
+        if (header.cid != 0)
+            header.cid = localCid(header.cid, sender);
+
+        // With SYN cookies, the connection only exists once the ACK is back.
+        // An ACK that only echoes options has nothing else to process.
+        if (synCookies && header.a && !header.s && header.cid != 0 && !ownsCid(header.cid, sender) &&
+            completeCookie(header, payload, sender) && header.o) {
+            logRecv(header);
+            return;
+        }
+
+        if ((header.cid != 0 && !ownsCid(header.cid, sender)) || (header.cid != 0 && !header.a && connections[header.cid].state == CState::ENDED)) {
+            drops++;
+            if (log) {
+                cout << "DROP " << header.seq << " " << header.ack << " " << header.cid;
+                if (header.a)
+                    cout << " ACK";
+                if (header.s)
+                    cout << " SYN";
+                if (header.f)
+                    cout << " FIN";
+                cout << endl;
+            }
+            return;
+        }
+        logRecv(header);
+
+        // Determine if the last packet was sent over 10 seconds ago. If so, change CState to ended and write ERROR to
+        // corresponding file. SYNs have no connection yet, so they are not tracked.
+        if (header.cid != 0 && lastPacketTimes.find(header.cid) != lastPacketTimes.end()) {
+            if (millisBetween(lastPacketTimes[header.cid], now) > tuning.timeoutTimer) {
+                if (log)
+                    cout << "Connection timeout." << endl;
+                expireConnection(connections[header.cid]);
+            } else {
+                // If no timeout, update the last packet received time.
+                lastPacketTimes[header.cid] = now;
+            }
+        } else if (header.cid != 0) {
+            // Create the entry if not present.
+            lastPacketTimes[header.cid] = now;
+        }
+
+        if (header.s) {
+            // After receiving a packet with SYN flag, the server should create state for the connection ID and proceed with 3-way handshake for this connection. Server should use 4321 as initial sequence number.
+            handleSyn(header, payload, sender);
+            return;
+        }
+
+        // A repeated options echo from the handshake, already handled.
+        if (header.o)
+            return;
+
+        auto it = connections.find(header.cid);
+        if (it == connections.end()) {
+            cerr << "Invalid header cid, not found in connections" << endl;
+            return;
+        }
+        auto& conn = it->second;
+
+        if (header.a) {
+            if (conn.state == CState::ENDED) {
+                // Finish up the connection
+                finishOutput(conn);
+                return;
+            }
+            if (conn.state == CState::ACK) {
+                conn.state = CState::STARTED;
+                // Resumable transfers already have their partial file open.
+                if (conn.file == nullptr)
+                    openOutput(conn);
+            }
+        }
+
+        if (header.f) {
+            handleFin(conn, header, sender);
+            return;
+        }
+
+        if (header.p) {
+            if (conn.state == CState::STARTED && conn.opts.fecK > 0)
+                handleParity(conn, header, payload, sender);
+            return;
+        }
+
+        if (conn.state == CState::STARTED)
+            handleData(conn, header, payload, sender);
+    }
+
+    // Sweeps idle connections once a second.
+    void tick() {
+        auto now = clock.now();
+        if (millisBetween(lastSweep, now) > 1000) {
+            sweepIdleConnections(now);
+            lastSweep = now;
+        }
+    }
+
+    // Keeps whatever resumable transfers have received so far, and ends the
+    // other unfinished ones like timed out ones: what they got goes where it
+    // would have ended up, followed by ERROR. Called from the main loop, not
+    // from a signal handler.
+    void shutdown() {
+        for (auto& entry: connections) {
+            auto& conn = entry.second;
+            if (conn.file == nullptr)
+                continue;
+            if (conn.opts.resumeToken != 0) {
+                checkpointConnection(conn);
+                conn.file->close();
+                conn.file.reset();
+            } else {
+                expireConnection(conn);
+            }
+        }
+    }
+
+    size_t connectionCount() const {
+        return connections.size();
+    }
+
+    string finalPath(uint16_t cid) const {
+        return saveDir + "/" + to_string(cid) + ".file";
+    }
+
+private:
+    Clock& clock;
+    PacketIO& io;
+    string saveDir;
+
+    unordered_map<uint16_t, Connection> connections;
+    unordered_map<uint16_t, timestamp_t> lastPacketTimes;
+    uint16_t connCnt = 1;
+    timestamp_t lastSweep;
+
+    // Connections by client address and ISN, so a retransmitted SYN gets the
+    // original answer instead of a second connection.
+    map<pair<uint64_t, uint32_t>, uint16_t> synIndex;
+    SynCookies cookies;
+
+    // Connections whose client knows them by another ID, by client address
+    // and that ID. See completeCookie.
+    map<pair<uint64_t, uint16_t>, uint16_t> cidAliases;
+
+    static uint64_t addressKey(const sockaddr& sender) {
+        auto in = (const sockaddr_in*) &sender;
+        return ((uint64_t) in->sin_addr.s_addr << 16) | in->sin_port;
+    }
+
+    static pair<uint64_t, uint32_t> synKey(const sockaddr& sender, uint32_t isn) {
+        return make_pair(addressKey(sender), isn);
+    }
+
+    // Whether cid is a connection with this client.
+    bool ownsCid(uint16_t cid, const sockaddr& sender) const {
+        auto it = connections.find(cid);
+        return it != connections.end() && addressKey(it->second.sender) == addressKey(sender);
+    }
+
+    // The connection a client means by the ID in its packets.
+    uint16_t localCid(uint16_t cid, const sockaddr& sender) const {
+        if (ownsCid(cid, sender))
+            return cid;
+        auto alias = cidAliases.find(make_pair(addressKey(sender), cid));
+        return alias != cidAliases.end() ? alias->second : cid;
+    }
+
+    void logRecv(const header_t& header) {
+        if (log)
+            logServerRecv(header);
+    }
+
+    // Whether cid belongs to a connection, or did to one whose file is still
+    // there. Ended connections are forgotten after a while, but handing their
+    // ID out again would put another transfer over their file.
+    bool cidInUse(uint16_t cid) const {
+        struct stat st;
+        return connections.find(cid) != connections.end() || stat(finalPath(cid).c_str(), &st) == 0;
+    }
+
+    // Returns an unused connection ID at or after start, or 0 if all are taken.
+    uint16_t findFreeCid(uint16_t start) {
+        for (uint32_t i = 0; i < 65536; i++) {
+            uint16_t cid = start + i;
+            if (cid != 0 && !cidInUse(cid))
+                return cid;
+        }
+        return 0;
+    }
+
+    void sendPacket(const header_t& header, const char* payload, size_t size, const sockaddr& to) {
+        char sendBuffer[MAX_PACKET_SIZE];
+        auto packetSize = formatSendPacket(sendBuffer, header, payload, size);
+        io.send(sendBuffer, packetSize, to);
+        if (log)
+            logServerSend(header);
+    }
+
+    // The options to confirm to the client, out of the ones it asked for.
+    static options_t replyOptions(const options_t& opts) {
+        options_t reply;
+        reply.compress = opts.compress;
+        reply.resumed = opts.resumed;
+        reply.resumeOffset = opts.resumeOffset;
+        reply.cookie = opts.cookie;
+        reply.fecK = opts.fecK;
+        reply.fecM = opts.fecM;
+        reply.dedup = opts.dedup;
+        return reply;
+    }
+
+    // FEC is taken as asked for, within the limits of fec.hpp.
+    static void acceptFec(options_t& opts) {
+        if (opts.fecK == 0 || opts.fecM == 0) {
+            opts.fecK = opts.fecM = 0;
+            return;
+        }
+        opts.fecK = min(opts.fecK, (uint8_t) FEC_MAX_K);
+        opts.fecM = min(opts.fecM, (uint8_t) FEC_MAX_M);
+    }
+
+    // Deduplication works on the raw file from the start, so it is declined
+    // along with compression or resuming.
+    static void acceptDedup(options_t& opts) {
+        if (opts.compress || opts.resumeToken != 0)
+            opts.dedup = false;
+    }
+
+    // Opens the file a new transfer is received into. It only gets its final
+    // name once the transfer is over, see finishOutput.
+    bool openOutput(Connection& conn) {
+        conn.stagingPath = saveDir + "/." + to_string(conn.cid) + ".file.tmp";
+        conn.dedup.dir = saveDir;
+        conn.file = storageFactory();
+        if (!conn.file->open(conn.stagingPath, 0, conn.opts.fileSize)) {
+            perror("Failed to open output file");
+            conn.file.reset();
+            return false;
+        }
+        return true;
+    }
+
+    // Closes the output and moves it to <cid>.file. A resumable transfer's
+    // progress is no longer needed after that.
+    void finishOutput(Connection& conn) {
+        if (conn.file == nullptr)
+            return;
+        if (!conn.file->finish(conn.stagingPath, finalPath(conn.cid)))
+            perror("Failed to move output file into place");
+        conn.file.reset();
+
+        if (conn.opts.resumeToken != 0)
+            remove(checkpointPath(saveDir, conn.opts.resumeToken).c_str());
+    }
+
+    // Syncs a resumable transfer's partial file and records how far it got. Only
+    // whole compressed blocks count, so a resumed stream starts on a block.
+    void checkpointConnection(Connection& conn) {
+        if (conn.file == nullptr)
+            return;
+        if (!conn.file->sync()) {
+            perror("fsync failed");
+            return;
+        }
+
+        checkpoint_t ckpt;
+        ckpt.streamOffset = conn.streamBytes - conn.decoder.pending.size();
+        ckpt.fileBytes = conn.fileBytes;
+        ckpt.compress = conn.opts.compress;
+        if (!saveCheckpoint(checkpointPath(saveDir, conn.opts.resumeToken), ckpt))
+            cerr << "Failed to checkpoint cid=" << conn.cid << endl;
+        conn.checkpointedBytes = conn.fileBytes;
+    }
+
+    // Writes in-order stream data to the connection's file, decompressing it
+    // first when the connection negotiated compression, or putting it
+    // together with stored chunks for deduplication. Returns false once the
+    // stream can't be written; the connection has then failed and ended, so
+    // nothing more gets acknowledged and the client doesn't take it for a
+    // finished transfer.
+    bool writeData(Connection& conn, const string& data) {
+        if (conn.file == nullptr) {
+            cerr << "File ptr is nullptr when trying to write to file cid=" << conn.cid << endl;
+            failConnection(conn);
+            return false;
+        }
+
+        if (conn.opts.dedup) {
+            uint32_t written = 0;
+            auto write = [&](const char* chunk, size_t size) {
+                written += size;
+                return conn.file->write(chunk, size);
+            };
+            if (!conn.dedup.feed(data.data(), data.size(), write)) {
+                cerr << "Corrupt deduplicated stream or chunk store for cid=" << conn.cid << endl;
+                failConnection(conn);
+                return false;
+            }
+            conn.streamBytes += data.size();
+            conn.fileBytes += written;
+            return true;
+        }
+
+        const string* out = &data;
+        string decoded;
+        if (conn.opts.compress) {
+            if (!conn.decoder.feed(data.data(), data.size(), decoded)) {
+                cerr << "Corrupt compressed stream for cid=" << conn.cid << endl;
+                failConnection(conn);
+                return false;
+            }
+            out = &decoded;
+        }
+
+        if (!conn.file->write(out->data(), out->size())) {
+            perror("Write failed");
+            failConnection(conn);
+            return false;
+        }
+
+        conn.streamBytes += data.size();
+        conn.fileBytes += out->size();
+        if (conn.opts.resumeToken != 0 && conn.fileBytes - conn.checkpointedBytes >= CHECKPOINT_INTERVAL)
+            checkpointConnection(conn);
+        return true;
+    }
+
+    // Ends a connection whose data can't be written, like one that timed
+    // out: the file gets ERROR. A resumable transfer is checkpointed up to
+    // the data written before the failure.
+    void failConnection(Connection& conn) {
+        if (log)
+            cout << "Connection failed." << endl;
+        expireConnection(conn);
+    }
+
+    // Looks up how far an earlier attempt at a resumable transfer got.
+    checkpoint_t findCheckpoint(const options_t& opts) {
+        checkpoint_t ckpt;
+        struct stat st;
+        bool valid = loadCheckpoint(checkpointPath(saveDir, opts.resumeToken), ckpt) &&
+                     ckpt.compress == opts.compress &&
+                     stat(partialPath(saveDir, opts.resumeToken).c_str(), &st) == 0 &&
+                     (uint64_t) st.st_size >= ckpt.fileBytes;
+        return valid ? ckpt : checkpoint_t();
+    }
+
+    // Opens the partial file of a resumable transfer and works out where it
+    // continues from. Anything past the last checkpoint is cut off, since it may
+    // not have made it to disk intact.
+    void resumeConnection(Connection& conn) {
+        mkdir((saveDir + "/" + PARTIAL_DIR).c_str(), 0755);
+
+        conn.stagingPath = partialPath(saveDir, conn.opts.resumeToken);
+        checkpoint_t ckpt = findCheckpoint(conn.opts);
+
+        conn.file = storageFactory();
+        if (!conn.file->open(conn.stagingPath, ckpt.fileBytes, conn.opts.fileSize)) {
+            cerr << "Failed to open partial file for cid=" << conn.cid << ", resuming is off" << endl;
+            conn.file.reset();
+            conn.opts.resumeToken = 0;
+            return;
+        }
+
+        conn.streamBytes = ckpt.streamOffset;
+        conn.fileBytes = ckpt.fileBytes;
+        conn.checkpointedBytes = ckpt.fileBytes;
+        conn.head = (conn.head + ckpt.streamOffset) % MAX_SEQ_NUM;
+        conn.opts.resumed = true;
+        conn.opts.resumeOffset = ckpt.streamOffset;
+        if (ckpt.streamOffset > 0 && log)
+            cerr << "cid=" << conn.cid << " resumes transfer " << tokenName(conn.opts.resumeToken)
+                 << " at offset " << ckpt.streamOffset << endl;
+    }
+
+    // A client resuming a transfer has given up on any connection still
+    // receiving it, say after a NAT rebinding. That connection ends with ERROR
+    // but without a checkpoint or a normal close: the new one takes over the
+    // partial file from the last checkpoint, and may finish and rename it
+    // before the old one would have expired.
+    void retireResumeOwner(uint64_t token, uint16_t cid) {
+        for (auto& entry: connections) {
+            auto& old = entry.second;
+            if (old.cid == cid || old.opts.resumeToken != token || (old.state == CState::ENDED && old.file == nullptr))
+                continue;
+            if (log)
+                cerr << "cid=" << old.cid << " replaced by cid=" << cid << " resuming " << tokenName(token) << endl;
+            if (old.file != nullptr)
+                old.file->abandon();
+            old.file.reset();
+            old.state = CState::ENDED;
+            writeErrorFile(old.cid);
+        }
+    }
+
+    // Answers a SYN. Normally the connection is created right away, and a file
+    // start sent along with the SYN is written straight to it. With SYN cookies
+    // nothing is kept until the client's ACK shows it got the SYN-ACK.
+    void handleSyn(const header_t& header, const string& payload, const sockaddr& sender) {
+        auto key = synKey(sender, header.seq);
+        auto known = synIndex.find(key);
+        if (known != synIndex.end()) {
+            auto it = connections.find(known->second);
+            if (it != connections.end() && it->second.state != CState::ENDED) {
+                // Retransmitted SYN, so our SYN-ACK was lost. Send it again.
+                auto& conn = it->second;
+                sendPacket(conn.synAck, conn.synAckOptions.data(), conn.synAckOptions.size(), sender);
+                return;
+            }
+            synIndex.erase(known);
+        }
+
+        // Accept every option the client asks for that we understand, and
+        // tell it which ones those were. Plain SYNs get a plain SYN-ACK.
+        options_t opts;
+        size_t optSize = 0;
+        if (header.o && (optSize = parseOptions(payload.data(), payload.size(), opts)) == 0) {
+            cerr << "Malformed SYN options, ignoring them" << endl;
+            opts = options_t();
+        }
+        string early = optSize > 0 ? payload.substr(optSize) : string();
+        acceptFec(opts);
+        acceptDedup(opts);
+
+        uint16_t cid = findFreeCid(synCookies ? cookies.cidHint(sender, header.seq) : connCnt);
+        if (cid == 0) {
+            cerr << "No free connection ID, dropping SYN" << endl;
+            return;
+        }
+
+        header_t resHeader {
+            4321,
+            header.seq + 1,
+            cid,
+            true, true, false
+        };
+        resHeader.o = header.o;
+        char optBuffer[MAX_PAYLOAD_SIZE];
+
+        if (synCookies) {
+            // The offset is looked up again when the connection is created.
+            if (opts.resumeToken != 0) {
+                opts.resumed = true;
+                opts.resumeOffset = findCheckpoint(opts).streamOffset;
+            }
+            opts.cookie = header.o;
+            resHeader.seq = cookies.make(sender, header.seq, cid, payload.substr(0, optSize), SynCookies::slotAt(clock.now()));
+            sendPacket(resHeader, optBuffer, header.o ? formatOptions(optBuffer, replyOptions(opts)) : 0, sender);
+            return;
+        }
+
+        // Create new connection with unique id
+        connCnt = cid + 1;
+        auto& conn = connections.emplace(cid, Connection { cid, sender, opts }).first->second;
+        conn.peerIsn = header.seq;
+        conn.head = (header.seq + 1) % MAX_SEQ_NUM;
+        synIndex[key] = cid;
+        lastPacketTimes[cid] = clock.now();
+
+        if (opts.resumeToken != 0) {
+            retireResumeOwner(opts.resumeToken, conn.cid);
+            resumeConnection(conn);
+        }
+
+        // Data on the SYN is the start of the file. It is acknowledged like
+        // data, unless we can't take it because the transfer is resuming later.
+        if (!early.empty() && conn.opts.resumeOffset == 0 && (conn.file != nullptr || openOutput(conn))) {
+            conn.state = CState::STARTED;
+            if (writeData(conn, early)) {
+                advanceHead(conn, early.size());
+                resHeader.ack += early.size();
+            }
+        }
+
+        conn.synAck = resHeader;
+        if (header.o)
+            conn.synAckOptions = string(optBuffer, formatOptions(optBuffer, replyOptions(conn.opts)));
+        sendPacket(resHeader, conn.synAckOptions.data(), conn.synAckOptions.size(), sender);
+    }
+
+    // Creates the connection for an ACK that answers a cookie SYN-ACK. A client
+    // that negotiated options echoes them in this ACK. Returns false if the ACK
+    // doesn't carry a valid cookie.
+    //
+    // The ID offered in the SYN-ACK was free then, but nothing was kept, so
+    // another client may have been offered the same one and got there first,
+    // or even finished. The connection then gets a free ID of its own, and
+    // the client's packets are mapped to it; header is changed to match.
+    bool completeCookie(header_t& header, const string& payload, const sockaddr& sender) {
+        options_t opts;
+        size_t optSize = 0;
+        if (header.o && (optSize = parseOptions(payload.data(), payload.size(), opts)) == 0)
+            return false;
+
+        uint32_t isn = header.seq - 1;
+        uint32_t cookie = header.ack - 1;
+        if (!cookies.check(sender, isn, header.cid, payload.substr(0, optSize), cookie, SynCookies::slotAt(clock.now())))
+            return false;
+
+        uint16_t offered = header.cid;
+        if (cidInUse(offered)) {
+            header.cid = findFreeCid(connCnt);
+            if (header.cid == 0) {
+                cerr << "No free connection ID, dropping cookie ACK" << endl;
+                header.cid = offered;
+                return false;
+            }
+            connCnt = header.cid + 1;
+            cidAliases[make_pair(addressKey(sender), offered)] = header.cid;
+        }
+
+        opts.cookie = header.o;
+        acceptFec(opts);
+        acceptDedup(opts);
+        auto& conn = connections.emplace(header.cid, Connection { header.cid, sender, opts }).first->second;
+        conn.wireCid = offered;
+        conn.isn = cookie;
+        conn.peerIsn = isn;
+        conn.head = header.seq % MAX_SEQ_NUM;
+        synIndex[synKey(sender, isn)] = header.cid;
+        lastPacketTimes[header.cid] = clock.now();
+
+        if (opts.resumeToken != 0) {
+            retireResumeOwner(opts.resumeToken, conn.cid);
+            resumeConnection(conn);
+        }
+
+        char optBuffer[MAX_PAYLOAD_SIZE];
+        conn.synAck = header_t { cookie, header.seq, offered, true, true, false };
+        conn.synAck.o = header.o;
+        if (header.o)
+            conn.synAckOptions = string(optBuffer, formatOptions(optBuffer, replyOptions(conn.opts)));
+        return true;
+    }
+
+    // After receiving a FIN, send an ACK and FIN back to back (but not closing
+    // the socket). A FIN for a connection that already ended is disregarded.
+    void handleFin(Connection& conn, const header_t& header, const sockaddr& sender) {
+        if (conn.state == CState::ENDED)
+            return;
+
+        sendPacket(header_t { conn.isn + 1, header.seq + 1, conn.wireCid, true, false, true }, nullptr, 0, sender);
+        conn.state = CState::ENDED;
+
+        // Nothing more is coming, so the file is complete. Transfers
+        // without data never opened it.
+        if (conn.file == nullptr)
+            openOutput(conn);
+        finishOutput(conn);
+
+        if (conn.opts.fecK > 0 && log)
+            cerr << "cid=" << conn.cid << " rebuilt " << conn.fec.recovered << " segments from parity" << endl;
+        if (conn.opts.dedup && log) {
+            auto& stats = conn.dedup.stats;
+            cerr << "cid=" << conn.cid << " received " << stats.sentChunks << " of " << stats.chunks << " chunks ("
+                 << stats.sentBytes << " of " << stats.rawBytes << " file bytes), the rest came from the chunk store" << endl;
+            if (!conn.dedup.complete())
+                cerr << "cid=" << conn.cid << " ended before all chunks arrived" << endl;
+        }
+        if (conn.opts.compress && log) {
+            auto& stats = conn.decoder.stats;
+            cerr << "cid=" << conn.cid << " received " << stats.streamBytes << " compressed bytes for "
+                 << stats.rawBytes << " file bytes (ratio " << stats.ratio() << ")" << endl;
+            if (!conn.decoder.pending.empty())
+                cerr << "cid=" << conn.cid << " ended with a partial compressed block" << endl;
+        }
+    }
+
+    // Writes data that continues the stream, queues data from further ahead,
+    // up to the receive window, and acknowledges everything received so far.
+    void handleData(Connection& conn, const header_t& header, const string& payload, const sockaddr& sender) {
+        if (conn.opts.fecK > 0)
+            conn.fec.addData(streamPosition(conn, header.seq), payload);
+
+        // How far ahead of the next expected byte this packet starts. Packets
+        // from the second half of the sequence space are behind it: copies of
+        // data already written, which only need the ACK again.
+        uint32_t ahead = (header.seq % MAX_SEQ_NUM + MAX_SEQ_NUM - conn.head) % MAX_SEQ_NUM;
+        if (ahead == 0) {
+            advanceHead(conn, payload.size());
+            if (!writeData(conn, payload))
+                return;
+        } else if (ahead + payload.size() <= tuning.rwnd) {
+            conn.queue.emplace(header.seq, DataPacket { header.seq, (uint32_t) payload.size(), payload });
+        }
+
+        if (drainQueue(conn))
+            sendAck(conn, sender, nullptr, 0);
+    }
+
+    // Rebuilds what a parity packet allows and queues it like received data.
+    // The ACK tells the client how many segments of the group were lost the
+    // first time the group is looked at, so it can adapt the redundancy.
+    void handleParity(Connection& conn, const header_t& header, const string& payload, const sockaddr& sender) {
+        fec_header_t fh;
+        if (!parseFecHeader(payload.data(), payload.size(), fh) || fh.k > conn.opts.fecK || fh.m > conn.opts.fecM)
+            return;
+
+        vector<pair<uint64_t, string>> rebuilt;
+        int lost = -1;
+        conn.fec.addParity(streamPosition(conn, header.seq), fh, payload.substr(FEC_HEADER_SIZE), rebuilt, lost);
+        for (auto& segment: rebuilt) {
+            if (segment.first < conn.streamBytes)
+                continue;
+            uint32_t seq = (conn.head + (segment.first - conn.streamBytes)) % MAX_SEQ_NUM;
+            conn.queue.emplace(seq, DataPacket { seq, (uint32_t) segment.second.size(), segment.second });
+        }
+        if (!drainQueue(conn))
+            return;
+        conn.fec.trim(conn.streamBytes);
+
+        char report[2] = { (char) max(lost, 0), (char) fh.k };
+        sendAck(conn, sender, report, lost >= 0 ? sizeof report : 0);
+    }
+
+    // Where a sequence number falls in the transfer stream, going by the next
+    // byte expected and how much of the stream has been written.
+    static uint64_t streamPosition(const Connection& conn, uint32_t seq) {
+        uint32_t ahead = (seq % MAX_SEQ_NUM + MAX_SEQ_NUM - conn.head) % MAX_SEQ_NUM;
+        if (ahead < MAX_SEQ_NUM / 2)
+            return conn.streamBytes + ahead;
+        return conn.streamBytes - min((uint64_t) (MAX_SEQ_NUM - ahead), (uint64_t) conn.streamBytes);
+    }
+
+    // Writes out the queued packets that now continue the stream. Written
+    // packets are dropped so they can't match again after the sequence
+    // number wraps. Returns false if writing failed the connection.
+    bool drainQueue(Connection& conn) {
+        auto next = conn.queue.find(conn.head);
+        while (next != conn.queue.end()) {
+            if (!writeData(conn, next->second.payload))
+                return false;
+            advanceHead(conn, next->second.size);
+            conn.queue.erase(next);
+            next = conn.queue.find(conn.head);
+        }
+        return true;
+    }
+
+    // Until the chunks start coming, every ACK repeats the answer to the
+    // manifest, in an ACK of its own if this one carries a payload already.
+    void sendAck(Connection& conn, const sockaddr& sender, const char* payload, size_t size) {
+        header_t header { conn.isn + 1, conn.head, conn.wireCid, true, false, false };
+        if (conn.opts.dedup && conn.dedup.awaitingChunks(conn.streamBytes)) {
+            options_t answer;
+            answer.answered = true;
+            answer.missingChunks = conn.dedup.answer;
+            char optBuffer[MAX_PAYLOAD_SIZE];
+            header_t answerHeader = header;
+            answerHeader.o = true;
+            sendPacket(answerHeader, optBuffer, formatOptions(optBuffer, answer), sender);
+            if (payload == nullptr)
+                return;
+        }
+        sendPacket(header, payload, size, sender);
+    }
+
+    static void advanceHead(Connection& conn, uint32_t size) {
+        conn.head += size;
+        if (conn.head >= MAX_SEQ_NUM) {
+            conn.head = conn.head % MAX_SEQ_NUM;
+            conn.wrap++;
+        }
+    }
+
+    // Ends a connection that has been silent for too long. The file gets ERROR
+    // written to it; a resumable transfer keeps its partial file for the next
+    // attempt and gets a separate file holding ERROR instead.
+    void expireConnection(Connection& conn) {
+        conn.state = CState::ENDED;
+        string payload {"ERROR"};
+
+        if (conn.opts.resumeToken != 0) {
+            checkpointConnection(conn);
+            if (conn.file != nullptr)
+                conn.file->close();
+            conn.file.reset();
+            writeErrorFile(conn.cid);
+            return;
+        }
+
+        if (conn.file == nullptr && !openOutput(conn)) {
+            cerr << "File ptr is null when trying to write ERROR from time out!" << endl;
+            return;
+        }
+        else if (!conn.file->write(payload.c_str(), payload.size())) {
+            cerr << "Failed to write to file for a closed connection due to timeout." << endl;
+        }
+        finishOutput(conn);
+    }
+
+    // Puts ERROR in <cid>.file for a connection whose received data lives
+    // elsewhere.
+    void writeErrorFile(uint16_t cid) {
+        string payload {"ERROR"};
+        FILE* fptr = fopen(finalPath(cid).c_str(), "wb");
+        if (fptr == nullptr || fwrite(payload.c_str(), 1, payload.size(), fptr) != payload.size())
+            cerr << "Failed to write to file for a closed connection due to timeout." << endl;
+        if (fptr != nullptr)
+            fclose(fptr);
+    }
+
+    // Connections are expired without waiting for another packet, so their
+    // file says ERROR (and a resumable transfer's progress is checkpointed)
+    // even if the client never comes back. Ended connections are forgotten
+    // once they have been quiet for a while, which frees their connection IDs.
+    void sweepIdleConnections(timestamp_t now) {
+        auto it = connections.begin();
+        while (it != connections.end()) {
+            auto& conn = it->second;
+            auto last = lastPacketTimes.find(conn.cid);
+            if (last != lastPacketTimes.end() && millisBetween(last->second, now) <= tuning.timeoutTimer) {
+                ++it;
+                continue;
+            }
+
+            // Half-open connections have nothing to clean up and are just dropped.
+            bool halfOpen = conn.state == CState::ACK && conn.file == nullptr;
+            if (conn.state != CState::ENDED && !halfOpen) {
+                if (log)
+                    cout << "Connection timeout." << endl;
+                expireConnection(conn);
+                lastPacketTimes[conn.cid] = now;
+                ++it;
+                continue;
+            }
+
+            auto key = synKey(conn.sender, conn.peerIsn);
+            auto known = synIndex.find(key);
+            if (known != synIndex.end() && known->second == conn.cid)
+                synIndex.erase(known);
+            if (conn.wireCid != conn.cid)
+                cidAliases.erase(make_pair(addressKey(conn.sender), conn.wireCid));
+            if (last != lastPacketTimes.end())
+                lastPacketTimes.erase(last);
+            it = connections.erase(it);
+        }
+    }
+};
@@ -0,0 +1,534 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <queue>
+#include <map>
+#include <set>
+#include <tuple>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <poll.h>
+
+#include "io.hpp"
+#include "protocol.hpp"
+#include "pcap.hpp"
+#include "udpstats.hpp"
+
+using namespace std;
+
+// Trace replay: sends the client side of captured Confundo connections to a
+// running server, with the capture's timing, scaled or as fast as possible,
+// and checks the server's answers and files against the capture. Every
+// replayed connection has its own socket, so copies of a connection look like
+// separate clients. The server picks new connection IDs, so a connection's
+// packets after the SYN wait for its SYN-ACK and are rewritten to the ID and
+// ISN it gave. As fast as possible still keeps the capture's windows: a
+// packet waits until the server answered as often as it had when the packet
+// was captured. Answers the server dropped are waited for four times as long
+// as answers take on average.
+
+struct replay_config_t {
+    vector<string> captures;
+    double speed = 1;   // 2 replays twice as fast as captured
+    bool fast = false;  // ignore the capture's timing
+    int copies = 1;     // times each connection is replayed at once
+    int serverPort = 0; // the server's port in the capture, 0 = where the first SYN went
+    string saveDir;     // the server's directory, to check the files it wrote
+    double linger = 1000; // ms to wait for the last answers
+};
+
+// A server packet as compared between capture and replay: sequence number
+// relative to the server's ISN, ACK number and flags.
+typedef tuple<uint32_t, uint32_t, int> response_t;
+
+response_t responseOf(const header_t& h, uint32_t serverIsn) {
+    return make_tuple(h.seq - serverIsn, h.ack, MASK_O * h.o + MASK_A * h.a + MASK_S * h.s + MASK_F * h.f);
+}
+
+struct client_packet_t {
+    double time;     // in the capture
+    size_t answered; // server packets of the connection captured before it
+    string data;
+};
+
+// One connection in a capture.
+struct flow_t {
+    string name;       // the client's address in the capture
+    vector<client_packet_t> packets;
+    size_t serverPackets = 0;
+    uint32_t isn = 0;
+    bool haveServerIsn = false;
+    uint32_t serverIsn = 0;
+    bool cookie = false;   // the captured SYN-ACK was a SYN cookie
+    string synOptions;     // the option block of the SYN
+    set<response_t> responses;
+
+    // The file the server should write, rebuilt from the data packets. Only
+    // plain streams can be rebuilt, and only finished ones are checked.
+    bool plain = true;
+    bool fin = false;
+    string file;
+    map<uint64_t, string> ahead;
+};
+
+string addressName(uint32_t addr, uint16_t port) {
+    struct in_addr in;
+    in.s_addr = htonl(addr);
+    return string(inet_ntoa(in)) + ":" + to_string(port);
+}
+
+// Adds the data of a packet to the file being rebuilt, the way the server
+// would: in order, copies ignored.
+void addData(flow_t& flow, uint32_t seq, const char* data, size_t size) {
+    uint32_t offset = (seq % MAX_SEQ_NUM + MAX_SEQ_NUM - (flow.isn + 1) % MAX_SEQ_NUM) % MAX_SEQ_NUM;
+    uint32_t ahead = (offset + MAX_SEQ_NUM - flow.file.size() % MAX_SEQ_NUM) % MAX_SEQ_NUM;
+    if (size == 0 || ahead >= MAX_SEQ_NUM / 2)
+        return;
+    flow.ahead.emplace(flow.file.size() + ahead, string(data, size));
+    auto next = flow.ahead.find(flow.file.size());
+    while (next != flow.ahead.end()) {
+        flow.file += next->second;
+        flow.ahead.erase(next);
+        next = flow.ahead.find(flow.file.size());
+    }
+}
+
+struct capture_stats_t {
+    uint64_t datagrams = 0;
+    uint64_t skipped = 0;  // neither to nor from the server, or not from a known connection
+};
+
+// Splits a capture into connections. Client packets are the ones sent to the
+// server's port; a SYN with a new ISN starts a new connection from its
+// address, a SYN with the same ISN is a retransmission.
+bool loadCapture(const string& path, int serverPort, vector<flow_t>& flows, capture_stats_t& stats) {
+    vector<datagram_t> datagrams;
+    pcap_stats_t pcap;
+    string error;
+    if (!readPcap(path, datagrams, pcap, error)) {
+        cerr << "ERROR: " << error << endl;
+        return false;
+    }
+    stats.datagrams += datagrams.size();
+
+    if (serverPort == 0) {
+        for (auto& d: datagrams) {
+            if (d.payload.size() >= 12 && !(d.payload[11] & MASK_A) && (d.payload[11] & MASK_S)) {
+                serverPort = d.dstPort;
+                break;
+            }
+        }
+    }
+
+    map<pair<uint32_t, uint16_t>, size_t> current;
+    for (auto& d: datagrams) {
+        if (d.payload.size() < 12 || (d.dstPort != serverPort && d.srcPort != serverPort)) {
+            stats.skipped++;
+            continue;
+        }
+        auto h = getHeader(&d.payload[0], d.payload.size());
+        bool fromClient = d.dstPort == serverPort;
+        auto key = fromClient ? make_pair(d.srcAddr, d.srcPort) : make_pair(d.dstAddr, d.dstPort);
+        auto known = current.find(key);
+
+        if (fromClient && h.s && !h.a && (known == current.end() || flows[known->second].isn != h.seq)) {
+            flows.emplace_back();
+            auto& flow = flows.back();
+            flow.name = path + " " + addressName(key.first, key.second);
+            flow.isn = h.seq;
+            current[key] = flows.size() - 1;
+
+            // The start of the file may come with the SYN.
+            options_t opts;
+            size_t optSize = 0;
+            if (h.o && (optSize = parseOptions(d.payload.data() + 12, d.payload.size() - 12, opts)) == 0)
+                flow.plain = false;
+            if (opts.compress || opts.dedup || opts.resumeToken != 0)
+                flow.plain = false;
+            flow.synOptions = d.payload.substr(12, optSize);
+            addData(flow, h.seq + 1, d.payload.data() + 12 + optSize, d.payload.size() - 12 - optSize);
+            flow.packets.push_back(client_packet_t { d.time, 0, d.payload });
+            continue;
+        }
+        if (known == current.end()) {
+            stats.skipped++;
+            continue;
+        }
+
+        auto& flow = flows[known->second];
+        if (fromClient) {
+            flow.packets.push_back(client_packet_t { d.time, flow.serverPackets, d.payload });
+            if (h.f)
+                flow.fin = true;
+            else if (!h.s && !h.o && !h.p)
+                addData(flow, h.seq, d.payload.data() + 12, d.payload.size() - 12);
+        } else {
+            flow.serverPackets++;
+            if (h.s && h.a && !flow.haveServerIsn) {
+                flow.haveServerIsn = true;
+                flow.serverIsn = h.seq;
+                options_t opts;
+                flow.cookie = h.o && parseOptions(d.payload.data() + 12, d.payload.size() - 12, opts) > 0 && opts.cookie;
+            }
+            if (flow.haveServerIsn)
+                flow.responses.insert(responseOf(h, flow.serverIsn));
+        }
+    }
+    return true;
+}
+
+class Replayer {
+public:
+    Replayer(const replay_config_t& cfg, const sockaddr& server, const vector<flow_t>& flows):
+        cfg(cfg), server(server), flows(flows) {
+        for (int copy = 0; copy < cfg.copies; copy++) {
+            for (size_t f = 0; f < flows.size(); f++) {
+                int fd = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
+                if (fd < 0) {
+                    perror("Failed to create socket, try fewer copies");
+                    exit(1);
+                }
+                connections.push_back(connection_t { f, copy });
+                fds.push_back(pollfd { fd, POLLIN, 0 });
+            }
+        }
+    }
+
+    void run() {
+        auto counters = readUdpCounters();
+        startTime = lastActivity = clock.now();
+        for (size_t c = 0; c < connections.size(); c++) {
+            if (!flows[connections[c].flow].packets.empty())
+                schedule(c);
+        }
+
+        while (true) {
+            auto now = clock.now();
+            auto sent = sentPackets;
+            while (!due.empty() && get<0>(due.top()) <= now) {
+                size_t c = get<2>(due.top());
+                due.pop();
+                sendNext(c);
+            }
+            if (sentPackets > sent)
+                lastSend = lastActivity = clock.now();
+
+            receive();
+
+            now = clock.now();
+            if (waiting > 0)
+                expireWaiting(now);
+            if (due.empty() && waiting == 0 && millisBetween(lastActivity, now) >= cfg.linger)
+                break;
+
+            auto until = due.empty() ? afterMillis(lastActivity, cfg.linger) : get<0>(due.top());
+            int timeout = until <= now ? 0 : (int) min(millisBetween(now, until) + 1, 10.0);
+            ::poll(fds.data(), fds.size(), timeout);
+        }
+
+        auto after = readUdpCounters();
+        drops.inErrors = after.inErrors - counters.inErrors;
+        drops.rcvbufErrors = after.rcvbufErrors - counters.rcvbufErrors;
+    }
+
+    int report() {
+        size_t failed = 0, matched = 0, missing = 0, unexpected = 0;
+        size_t same = 0, differ = 0, unchecked = 0;
+        for (auto& conn: connections) {
+            auto& flow = flows[conn.flow];
+            if (conn.cid < 0) {
+                failed++;
+                cerr << flow.name << " copy " << conn.copy << ": no SYN-ACK" << endl;
+                continue;
+            }
+
+            size_t connMatched = 0;
+            for (auto& response: conn.responses)
+                connMatched += flow.responses.count(response);
+            matched += connMatched;
+            missing += flow.responses.size() - connMatched;
+            unexpected += conn.responses.size() - connMatched;
+
+            string note;
+            if (connMatched < flow.responses.size())
+                note = to_string(flow.responses.size() - connMatched) + " captured responses missing";
+
+            if (cfg.saveDir.empty() || !flow.fin || !flow.plain) {
+                unchecked++;
+            } else if (readFile(cfg.saveDir + "/" + to_string(conn.cid) + ".file") == flow.file) {
+                same++;
+            } else {
+                differ++;
+                note += string(note.empty() ? "" : ", ") + "file differs";
+            }
+            if (!note.empty())
+                cerr << flow.name << " copy " << conn.copy << " (cid=" << conn.cid << "): " << note << endl;
+        }
+
+        double seconds = millisBetween(startTime, lastSend) / 1000;
+        cout << "replayed     " << connections.size() << " connections (" << flows.size() << " x " << cfg.copies << " copies), "
+             << sentPackets << " packets (" << sentBytes << " bytes) in " << seconds << " s" << endl;
+        cout << "rate         " << (seconds > 0 ? sentPackets / seconds : 0) << " packets/s, "
+             << (seconds > 0 ? sentBytes * 8 / seconds / 1e6 : 0) << " Mbit/s";
+        if (cfg.fast)
+            cout << ", " << unanswered << " packets sent without waiting for a missing answer";
+        cout << endl;
+        cout << "responses    " << receivedPackets << " received; " << matched << " captured responses seen, " << missing
+             << " missing, " << unexpected << " not in the capture" << endl;
+        cout << "files        " << same << " match, " << differ << " differ, " << unchecked
+             << " not checked (no --save, no FIN, or a compressed, deduplicated or resumed stream)" << endl;
+        cout << "failed       " << failed << " connections got no SYN-ACK" << endl;
+        cout << "udp drops    " << drops.rcvbufErrors << " receive buffer overflows, " << drops.inErrors
+             << " receive errors (host-wide, includes the server if it runs here)" << endl;
+        return failed == 0 && differ == 0 ? 0 : 1;
+    }
+
+private:
+    struct connection_t {
+        size_t flow;
+        int copy;
+        size_t next = 0;      // the next packet to send
+        int cid = -1;         // given by the server in the SYN-ACK
+        uint32_t serverIsn = 0;
+        size_t received = 0;
+        bool waiting = false; // for the SYN-ACK, or for answers when replaying fast
+        timestamp_t waitingSince;
+        set<response_t> responses;
+
+        connection_t(size_t flow, int copy): flow(flow), copy(copy) {}
+    };
+
+    replay_config_t cfg;
+    sockaddr server;
+    const vector<flow_t>& flows;
+    SystemClock clock;
+    vector<connection_t> connections;
+    vector<struct pollfd> fds; // one per connection
+    size_t waiting = 0;
+
+    // Packets by when they are due, then by their index, so connections
+    // take turns when replaying as fast as possible
+    typedef tuple<timestamp_t, size_t, size_t> due_t;
+    priority_queue<due_t, vector<due_t>, greater<due_t>> due;
+
+    timestamp_t startTime, lastSend, lastActivity;
+    uint64_t sentPackets = 0, sentBytes = 0, receivedPackets = 0, unanswered = 0;
+    double answerWait = 0; // average ms a packet waited for its answers
+    udp_counters_t drops;
+
+    void schedule(size_t c) {
+        auto& conn = connections[c];
+        double at = cfg.fast ? 0 : flows[conn.flow].packets[conn.next].time * 1000 / cfg.speed;
+        due.push(make_tuple(afterMillis(startTime, at), conn.next, c));
+    }
+
+    // Whether the connection's next packet can go: a SYN always can, the
+    // rest need the connection ID and, when replaying fast, the answers the
+    // packet was sent after.
+    bool ready(const connection_t& conn) const {
+        auto& packet = flows[conn.flow].packets[conn.next];
+        if (packet.data[11] & MASK_S)
+            return true;
+        return conn.cid >= 0 && (!cfg.fast || conn.received >= packet.answered);
+    }
+
+    void release(size_t c) {
+        connections[c].waiting = false;
+        waiting--;
+        due.push(make_tuple(clock.now(), connections[c].next, c));
+    }
+
+    // Sends the connection's next packet, or holds it until it is ready.
+    void sendNext(size_t c) {
+        auto& conn = connections[c];
+        auto& flow = flows[conn.flow];
+        if (!ready(conn)) {
+            conn.waiting = true;
+            conn.waitingSince = clock.now();
+            waiting++;
+            return;
+        }
+
+        string packet = flow.packets[conn.next].data;
+        auto h = getHeader(&packet[0], packet.size());
+        if (!h.s) {
+            int2buf(&packet[0], conn.cid, 8, 10);
+            if (flow.haveServerIsn && h.a)
+                int2buf(&packet[0], h.ack - flow.serverIsn + conn.serverIsn, 4, 8);
+        }
+
+        if (sendto(fds[c].fd, packet.data(), packet.size(), 0, &server, sizeof server) < 0)
+            perror("sendto failed");
+        sentPackets++;
+        sentBytes += packet.size();
+
+        if (++conn.next < flow.packets.size())
+            schedule(c);
+    }
+
+    void receive() {
+        char buffer[MAX_PACKET_SIZE];
+        auto now = clock.now();
+        for (size_t c = 0; c < fds.size(); c++) {
+            if (!(fds[c].revents & POLLIN))
+                continue;
+            fds[c].revents = 0;
+            auto& conn = connections[c];
+            ssize_t size;
+            while ((size = recv(fds[c].fd, buffer, sizeof buffer, MSG_DONTWAIT)) >= 12) {
+                receivedPackets++;
+                conn.received++;
+                lastActivity = now;
+                auto h = getHeader(buffer, size);
+                if (h.s && h.a && conn.cid < 0) {
+                    conn.cid = h.cid;
+                    conn.serverIsn = h.seq;
+                    echoCookie(c, h, buffer, size);
+                }
+                if (conn.cid >= 0)
+                    conn.responses.insert(responseOf(h, conn.serverIsn));
+            }
+            if (conn.waiting && ready(conn)) {
+                answerWait = 0.875 * answerWait + 0.125 * millisBetween(conn.waitingSince, now);
+                release(c);
+            }
+        }
+    }
+
+    // A server with SYN cookies needs the client's options echoed before the
+    // connection exists. If the captured server didn't use them, the capture
+    // has no echo, so send the one the client would have.
+    void echoCookie(size_t c, const header_t& synAck, const char* packet, size_t size) {
+        auto& flow = flows[connections[c].flow];
+        options_t opts;
+        if (flow.cookie || !synAck.o || parseOptions(packet + 12, size - 12, opts) == 0 || !opts.cookie)
+            return;
+
+        header_t echo { flow.isn + 1, synAck.seq + 1, synAck.cid, true, false, false };
+        echo.o = true;
+        char buffer[MAX_PACKET_SIZE];
+        size_t echoSize = formatSendPacket(buffer, echo, flow.synOptions.data(), flow.synOptions.size());
+        if (sendto(fds[c].fd, buffer, echoSize, 0, &server, sizeof server) < 0)
+            perror("sendto failed");
+        sentPackets++;
+        sentBytes += echoSize;
+    }
+
+    // Gives up on connections whose SYN-ACK hasn't come for TIMEOUT_TIMER,
+    // and stops waiting for answers that are taking much longer than usual.
+    void expireWaiting(timestamp_t now) {
+        double patience = min(RETRANSMISSION_TIMER, max(5.0, 4 * answerWait));
+        for (size_t c = 0; c < connections.size(); c++) {
+            auto& conn = connections[c];
+            if (!conn.waiting)
+                continue;
+            double waited = millisBetween(conn.waitingSince, now);
+            if (conn.cid < 0 && waited > TIMEOUT_TIMER) {
+                conn.waiting = false;
+                waiting--;
+            } else if (conn.cid >= 0 && waited > patience) {
+                // Count the missing answers as received, or every later
+                // packet would wait for them too.
+                conn.received = max(conn.received, flows[conn.flow].packets[conn.next].answered);
+                unanswered++;
+                release(c);
+            }
+        }
+    }
+
+    static string readFile(const string& path) {
+        ifstream in(path, ios::binary);
+        ostringstream contents;
+        contents << in.rdbuf();
+        return contents.str();
+    }
+};
+
+int main(int argc, const char * argv[]) {
+    if (argc < 4) {
+        std::cerr << "ERROR: Invalid number of arguments. Need IP address and port number of the server, and capture files." << endl;
+        exit(1);
+    }
+
+    replay_config_t cfg;
+    for (int i = 3; i < argc; i++) {
+        string flag(argv[i]);
+        if (flag.compare(0, 2, "--") != 0) {
+            cfg.captures.push_back(flag);
+            continue;
+        }
+        if (flag == "--fast") {
+            cfg.fast = true;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            std::cerr << "ERROR: Missing value for " << flag << endl;
+            exit(1);
+        }
+        string value(argv[++i]);
+        try {
+            if (flag == "--speed") {
+                cfg.speed = stod(value);
+            } else if (flag == "--copies") {
+                cfg.copies = stoi(value);
+            } else if (flag == "--server-port") {
+                cfg.serverPort = stoi(value);
+            } else if (flag == "--save") {
+                cfg.saveDir = value;
+            } else if (flag == "--linger") {
+                cfg.linger = stod(value);
+            } else {
+                std::cerr << "ERROR: Unknown option " << flag << endl;
+                exit(1);
+            }
+        } catch (std::exception const &e) {
+            std::cerr << "ERROR: Invalid value for " << flag << ": " << value << endl;
+            exit(1);
+        }
+    }
+    if (cfg.captures.empty() || cfg.speed <= 0 || cfg.copies <= 0 || cfg.linger < 0) {
+        std::cerr << "ERROR: Need capture files, and a positive speed and number of copies." << endl;
+        exit(1);
+    }
+
+    vector<flow_t> flows;
+    capture_stats_t stats;
+    for (auto& path: cfg.captures) {
+        if (!loadCapture(path, cfg.serverPort, flows, stats))
+            exit(1);
+    }
+    cout << "captures     " << cfg.captures.size() << " files, " << stats.datagrams << " datagrams, " << flows.size()
+         << " connections (" << stats.skipped << " datagrams of no known connection skipped)" << endl;
+    if (flows.empty()) {
+        std::cerr << "ERROR: No Confundo connections found in the capture." << endl;
+        exit(1);
+    }
+
+    struct addrinfo hints;
+    struct addrinfo *res;
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    auto ret = getaddrinfo(argv[1], argv[2], &hints, &res);
+    if (ret != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(ret));
+        exit(EXIT_FAILURE);
+    }
+    sockaddr server = *res->ai_addr;
+    freeaddrinfo(res);
+
+    Replayer replayer(cfg, server, flows);
+    replayer.run();
+    return replayer.report();
+}
@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <string>
+
+#include "util.hpp"
+
+#pragma once
+
+using namespace std;
+
+// Resumable transfers are keyed by a token the client derives from the file,
+// so a restarted client finds the progress of its earlier attempt. The server
+// keeps the partial file and a checkpoint of how much of it is safely on disk
+// under <dir>/.partial until the transfer completes.
+
+const char* const PARTIAL_DIR = ".partial";
+const uint32_t CHECKPOINT_INTERVAL = 1 << 20; // bytes written between checkpoints
+const size_t CHECKPOINT_SIZE = 13;
+
+struct checkpoint_t {
+    uint32_t streamOffset = 0; // transfer stream bytes covered by the file
+    uint32_t fileBytes = 0;    // bytes of the partial file that are valid
+    bool compress = false;     // the stream was a compressed block stream
+};
+
+const uint64_t FNV_OFFSET = 14695981039346656037ull;
+const uint64_t FNV_PRIME = 1099511628211ull;
+
+uint64_t fnv1a(uint64_t hash, const void* data, size_t size) {
+    const unsigned char* p = (const unsigned char*) data;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= p[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+// Derives the resume token from the file name, size, mtime and contents, and
+// whether it is sent compressed, since that changes what the offsets mean.
+// Returns 0 if the file can't be read.
+uint64_t transferToken(const char* path, bool compress) {
+    struct stat st;
+    FILE* fd = fopen(path, "rb");
+    if (fd == nullptr || fstat(fileno(fd), &st) != 0) {
+        if (fd != nullptr)
+            fclose(fd);
+        return 0;
+    }
+
+    const char* name = strrchr(path, '/');
+    name = name == nullptr ? path : name + 1;
+
+    uint64_t hash = fnv1a(FNV_OFFSET, name, strlen(name));
+    uint64_t size = st.st_size;
+    uint64_t mtime = st.st_mtime;
+    hash = fnv1a(hash, &size, sizeof size);
+    hash = fnv1a(hash, &mtime, sizeof mtime);
+    hash = fnv1a(hash, &compress, sizeof compress);
+
+    char chunk[65536];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof chunk, fd)) > 0)
+        hash = fnv1a(hash, chunk, n);
+    fclose(fd);
+
+    // 0 means "no token" on the wire.
+    return hash == 0 ? 1 : hash;
+}
+
+string tokenName(uint64_t token) {
+    char name[17];
+    snprintf(name, sizeof name, "%016llx", (unsigned long long) token);
+    return string(name);
+}
+
+string partialPath(const string& dir, uint64_t token) {
+    return dir + "/" + PARTIAL_DIR + "/" + tokenName(token) + ".part";
+}
+
+string checkpointPath(const string& dir, uint64_t token) {
+    return dir + "/" + PARTIAL_DIR + "/" + tokenName(token) + ".ckpt";
+}
+
+bool loadCheckpoint(const string& path, checkpoint_t& ckpt) {
+    char buf[CHECKPOINT_SIZE];
+    FILE* fd = fopen(path.c_str(), "rb");
+    if (fd == nullptr)
+        return false;
+    size_t n = fread(buf, 1, sizeof buf, fd);
+    fclose(fd);
+    if (n != sizeof buf)
+        return false;
+
+    ckpt.streamOffset = buf2int(buf, 0, 4);
+    ckpt.fileBytes = buf2int(buf, 4, 8);
+    ckpt.compress = buf[8] != 0;
+    // Guard against a torn or foreign file.
+    return buf2int(buf, 9, 13) == (uint32_t) (ckpt.streamOffset ^ ckpt.fileBytes ^ 0x5a5a5a5a);
+}
+
+// Replaces the checkpoint atomically: write a temp file, sync it, rename.
+bool saveCheckpoint(const string& path, const checkpoint_t& ckpt) {
+    char buf[CHECKPOINT_SIZE];
+    int2buf(buf, ckpt.streamOffset, 0, 4);
+    int2buf(buf, ckpt.fileBytes, 4, 8);
+    buf[8] = ckpt.compress;
+    int2buf(buf, ckpt.streamOffset ^ ckpt.fileBytes ^ 0x5a5a5a5a, 9, 13);
+
+    string tmp = path + ".tmp";
+    FILE* fd = fopen(tmp.c_str(), "wb");
+    if (fd == nullptr)
+        return false;
+    bool ok = fwrite(buf, 1, sizeof buf, fd) == sizeof buf && fflush(fd) == 0 && fsync(fileno(fd)) == 0;
+    fclose(fd);
+    return ok && rename(tmp.c_str(), path.c_str()) == 0;
+}
@@ -0,0 +1,763 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "io.hpp"
+#include "protocol.hpp"
+#include "compress.hpp"
+#include "dedup.hpp"
+#include "fec.hpp"
+#include "resume.hpp"
+#include "tuning.hpp"
+
+#pragma once
+
+using namespace std;
+
+// Where the client's stream bytes come from.
+class Source {
+public:
+    virtual ~Source() {}
+
+    // Reads up to size bytes at offset, returns how many were read.
+    virtual size_t read(uint32_t offset, char* buf, size_t size) = 0;
+    virtual uint32_t size() const = 0;
+};
+
+class FileSource : public Source {
+public:
+    FileSource(FILE* fd, uint32_t size): fd(fd), fileSize(size) {}
+
+    size_t read(uint32_t offset, char* buf, size_t size) override {
+        ssize_t n = pread(fileno(fd), buf, size, offset);
+        return n < 0 ? 0 : n;
+    }
+
+    uint32_t size() const override {
+        return fileSize;
+    }
+
+private:
+    FILE* fd;
+    uint32_t fileSize;
+};
+
+// Generated file contents, the same for the same size and seed, for
+// simulated and load test transfers that shouldn't need real files.
+class SyntheticSource : public Source {
+public:
+    SyntheticSource(uint32_t size, uint64_t seed): fileSize(size), seed(seed) {}
+
+    size_t read(uint32_t offset, char* buf, size_t size) override {
+        if (offset >= fileSize)
+            return 0;
+        size = min(size, (size_t) (fileSize - offset));
+        for (size_t i = 0; i < size; i++) {
+            uint64_t x = (offset + i) * 0x9e3779b97f4a7c15ull ^ seed;
+            buf[i] = (char) (x >> 29);
+        }
+        return size;
+    }
+
+    uint32_t size() const override {
+        return fileSize;
+    }
+
+    uint64_t hash() {
+        uint64_t h = FNV_OFFSET;
+        char chunk[65536];
+        for (uint32_t offset = 0; offset < fileSize; offset += sizeof chunk)
+            h = fnv1a(h, chunk, read(offset, chunk, sizeof chunk));
+        return h;
+    }
+
+private:
+    uint32_t fileSize;
+    uint64_t seed;
+};
+
+// The stream of a deduplicated transfer: the chunk manifest, then the
+// chunks of raw the server asked for. Until it answers, the stream ends
+// after the manifest.
+class DedupSource : public Source {
+public:
+    DedupSource(Source& raw, const vector<chunk_t>& chunks):
+        raw(raw), chunks(chunks), manifest(formatManifest(chunks)), streamSize(manifest.size()) {}
+
+    // Appends the chunks in ranges to the stream.
+    void select(const chunk_ranges_t& ranges) {
+        for (auto& range: ranges) {
+            for (uint32_t i = range.first; i < range.first + range.second; i++) {
+                starts.push_back(streamSize);
+                selected.push_back(i);
+                streamSize += chunks[i].size;
+                selectedBytes += chunks[i].size;
+            }
+        }
+    }
+
+    size_t read(uint32_t offset, char* buf, size_t size) override {
+        size_t done = 0;
+        while (done < size && offset < streamSize) {
+            size_t n;
+            if (offset < manifest.size()) {
+                n = min(size - done, manifest.size() - offset);
+                memcpy(buf + done, manifest.data() + offset, n);
+            } else {
+                // The last selected chunk starting at or before offset
+                size_t i = upper_bound(starts.begin(), starts.end(), offset) - starts.begin() - 1;
+                auto& chunk = chunks[selected[i]];
+                uint32_t within = offset - starts[i];
+                n = raw.read(chunk.offset + within, buf + done, min(size - done, (size_t) (chunk.size - within)));
+                if (n == 0)
+                    break;
+            }
+            done += n;
+            offset += n;
+        }
+        return done;
+    }
+
+    uint32_t size() const override {
+        return streamSize;
+    }
+
+    uint32_t chunkCount() const { return chunks.size(); }
+    uint32_t selectedCount() const { return selected.size(); }
+    uint32_t selectedSize() const { return selectedBytes; }
+    uint32_t manifestSize() const { return manifest.size(); }
+
+private:
+    Source& raw;
+    vector<chunk_t> chunks;
+    string manifest;
+    uint32_t streamSize;
+    uint32_t selectedBytes = 0;
+    vector<uint32_t> starts;   // stream offset of each selected chunk
+    vector<uint32_t> selected; // chunk index of each selected chunk
+};
+
+enum class SenderState {
+    SYN_SENT,
+    ESTABLISHED,
+    CLOSING,   // FIN sent, answering the server's FINs for two seconds or more
+    CLOSED,
+    ABORTED
+};
+
+struct sender_config_t {
+    // Options to ask for in the SYN; negotiate sends the option block at all
+    options_t wanted;
+    bool negotiate = false;
+    // Send the start of the stream along with the SYN
+    bool zeroRtt = false;
+    // Print the packet log to stdout and notes to stderr
+    bool log = true;
+    // Our initial sequence number. Sessions sharing a socket need different
+    // ones, since the server tells SYNs apart by address and ISN.
+    uint32_t isn = 12345;
+    // Window limits and timers
+    tuning_t tuning;
+};
+
+// The client side of a transfer: handshake, sending with congestion control,
+// cumulative ACKs, retransmission and the FIN. Packets go out through io,
+// time comes from clock, and received packets are fed in with onPacket.
+// poll runs the timers and sends whatever the window allows; it has to be
+// called again by deadline() at the latest.
+class Sender {
+public:
+    struct meta_t {
+        uint32_t offset;
+        uint32_t size;
+        uint32_t seq;
+        uint32_t expected_ack;
+        timestamp_t time;
+        bool retransmitted;
+        // What had been acknowledged when it was sent, and when, for the
+        // delivery rate
+        uint32_t delivered;
+        timestamp_t deliveredTime;
+    };
+
+    // packed is the compressed block stream of raw, or nullptr when the
+    // client didn't ask for compression. chunked is the deduplicated stream
+    // of raw, or nullptr when the client didn't ask for deduplication.
+    Sender(Clock& clock, PacketIO& io, const sockaddr& server, Source& raw, Source* packed, sender_config_t cfg,
+           const compress_stats_t& stats = compress_stats_t(), DedupSource* chunked = nullptr):
+        clock(clock), io(io), server(server), raw(raw), packed(packed), chunked(chunked), cfg(cfg), stats(stats),
+        status(SenderState::SYN_SENT), src(&raw), cwnd(cfg.tuning.minCwnd), ssThresh(cfg.tuning.initSsThresh) {}
+
+    // Sends the SYN: the option block, then as much of the stream as fits
+    // if zeroRtt is set.
+    void start() {
+        synHeader = header_t { cfg.isn, 0, 0, false, true, false };
+        char optBuffer[MAX_PAYLOAD_SIZE];
+        if (cfg.negotiate) {
+            synHeader.o = true;
+            optBlock = string(optBuffer, formatOptions(optBuffer, cfg.wanted));
+        }
+
+        synPayload = optBlock;
+        if (cfg.zeroRtt) {
+            Source* first = packed != nullptr ? packed : &raw;
+            char early[MAX_PAYLOAD_SIZE];
+            synPayload.append(early, first->read(0, early, MAX_PAYLOAD_SIZE - optBlock.size()));
+        }
+        earlySize = synPayload.size() - optBlock.size();
+
+        synStart = clock.now();
+        sendSyn();
+    }
+
+    void onPacket(const header_t& header, const string& payload, timestamp_t at) {
+        switch (status) {
+            case SenderState::SYN_SENT:
+                if (header.s)
+                    establish(header, payload, at);
+                break;
+            case SenderState::ESTABLISHED:
+                onAck(header, payload, at);
+                break;
+            case SenderState::CLOSING:
+                logRecv(header);
+                // Answer every FIN with an ACK, looking like the reference client.
+                if (header.f) {
+                    finAnswered = true;
+                    send(header_t { header.ack, header.seq + 1, cid, true, false, false });
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+    // Runs the timers and sends what the window allows. Returns whether it
+    // sent anything.
+    bool poll() {
+        auto now = clock.now();
+        sentPackets = 0;
+
+        switch (status) {
+            case SenderState::SYN_SENT:
+                // The SYN is repeated until the server answers, for up to the timeout.
+                if (millisBetween(synStart, now) >= cfg.tuning.timeoutTimer)
+                    status = SenderState::ABORTED;
+                else if (millisBetween(lastSent, now) >= cfg.tuning.retransmissionTimer)
+                    sendSyn();
+                break;
+            case SenderState::ESTABLISHED:
+                // Abort after 10 seconds (by default) of silence from the server.
+                if (millisBetween(lastReceive, now) > cfg.tuning.timeoutTimer) {
+                    status = SenderState::ABORTED;
+                    break;
+                }
+                checkTimeout(now);
+                sendWindow();
+                break;
+            case SenderState::CLOSING:
+                // Wait for two seconds after the FIN, or long enough to repeat
+                // it a few times with a long retransmission timer. The FIN is
+                // repeated until the server answers it.
+                if (millisBetween(finStart, now) >= closingTime())
+                    status = SenderState::CLOSED;
+                else if (!finAnswered && millisBetween(lastSent, now) >= cfg.tuning.retransmissionTimer)
+                    sendFin();
+                break;
+            default:
+                break;
+        }
+        return sentPackets > 0;
+    }
+
+    // The latest time poll has to run again.
+    timestamp_t deadline() const {
+        switch (status) {
+            case SenderState::SYN_SENT:
+                return min(afterMillis(lastSent, cfg.tuning.retransmissionTimer), afterMillis(synStart, cfg.tuning.timeoutTimer));
+            case SenderState::ESTABLISHED: {
+                auto silence = afterMillis(lastReceive, cfg.tuning.timeoutTimer + 1);
+                if (packetInfo.empty())
+                    return silence;
+                return min(silence, afterMillis(packetInfo.front().time, cfg.tuning.retransmissionTimer));
+            }
+            case SenderState::CLOSING: {
+                auto end = afterMillis(finStart, closingTime());
+                return finAnswered ? end : min(end, afterMillis(lastSent, cfg.tuning.retransmissionTimer));
+            }
+            default:
+                return timestamp_t::max();
+        }
+    }
+
+    SenderState state() const { return status; }
+    bool done() const { return status == SenderState::CLOSED || status == SenderState::ABORTED; }
+    uint16_t connectionId() const { return cid; }
+    uint32_t streamSize() const { return fileSize; }
+    uint32_t transmitted() const { return transmittedBytes; }
+    uint32_t timeouts() const { return timeoutCount; }
+    uint32_t parityPackets() const { return paritySent; }
+    // The bandwidth-delay product auto tuning measured, 0 until it has
+    uint32_t measuredBdp() const { return bdp; }
+
+    // Smoothed RTT and its variation in milliseconds, as in RFC 6298
+    double srtt = 0, rttvar = 0;
+    uint32_t rttSamples = 0;
+
+private:
+    Clock& clock;
+    PacketIO& io;
+    sockaddr server;
+    Source& raw;
+    Source* packed;
+    DedupSource* chunked;
+    sender_config_t cfg;
+    compress_stats_t stats;
+
+    SenderState status;
+    Source* src;          // what is being sent, raw or packed
+    uint32_t fileSize = 0;
+    // The stream ends after the manifest until the server says which chunks
+    // it needs
+    bool awaitingChunks = false;
+
+    header_t synHeader;
+    string optBlock;      // our option block, echoed in the ACK for a SYN cookie
+    string synPayload;
+    uint32_t earlySize = 0;
+    timestamp_t synStart;
+    timestamp_t lastSent; // last SYN or FIN
+
+    uint16_t cid = 0;
+    options_t opts;       // what the server agreed to
+    header_t echoHeader;
+
+    uint32_t cwnd;
+    uint32_t ssThresh;
+    uint32_t sentBytes = 0;        // the first byte that is not yet sent
+    uint32_t transmittedBytes = 0; // the first byte that is not successfully transmitted
+    // Highest offset sent so far; anything sent below it is a retransmission
+    // and gives no RTT sample (Karn's algorithm).
+    uint32_t highestSent = 0;
+    uint32_t seqStart = 0;
+    uint32_t currReceivedSeq = 0;
+    uint32_t receivedAck = 0;
+    uint32_t firstOffset = 0;      // where the data starts after the handshake
+    timestamp_t lastReceive;
+    uint32_t timeoutCount = 0;
+    timestamp_t lastDelivery;      // when transmittedBytes last moved
+
+    // Auto tuning: the highest delivery rate (bytes per millisecond) and the
+    // lowest RTT seen while the window opens. Measuring stops once the rate
+    // hasn't grown by a quarter for three round trips, or at the first
+    // timeout. A round trip ends when the data sent before it is acknowledged.
+    bool measuring = false;
+    double maxRate = 0;
+    double minRtt = 0;
+    double plateauRate = 0;
+    int plateauRounds = 0;
+    uint32_t roundEnd = 0;
+    uint32_t bdp = 0;
+
+    // Packets in flight, oldest first
+    vector<meta_t> packetInfo;
+
+    // Forward error correction, when the server agreed to it: the group of
+    // new segments being collected, the parity rows sent per group (adapted
+    // to the loss the server reports, up to opts.fecM) and that loss.
+    uint32_t segmentSize = MAX_PAYLOAD_SIZE;
+    vector<string> group;
+    uint32_t groupSeq = 0;
+    int fecM = 1;
+    double fecLoss = 0;
+    uint32_t paritySent = 0;
+
+    timestamp_t finStart;
+    bool finAnswered = false;
+    uint32_t sentPackets = 0;
+
+    void send(const header_t& header, const char* payload = nullptr, size_t size = 0) {
+        char buffer[MAX_PACKET_SIZE];
+        auto packetSize = formatSendPacket(buffer, header, payload, size);
+        io.send(buffer, packetSize, server);
+        if (cfg.log)
+            logClientSend(header, cwnd, ssThresh, false);
+        sentPackets++;
+    }
+
+    void logRecv(const header_t& header) {
+        if (cfg.log)
+            logClientRecv(header, cwnd, ssThresh);
+    }
+
+    void sendSyn() {
+        lastSent = clock.now();
+        send(synHeader, synPayload.data(), synPayload.size());
+    }
+
+    double closingTime() const {
+        return max(2000.0, 4 * cfg.tuning.retransmissionTimer);
+    }
+
+    void sendFin() {
+        lastSent = clock.now();
+        send(header_t { receivedAck, 0, cid, false, false, true });
+    }
+
+    void establish(const header_t& synAck, const string& payload, timestamp_t at) {
+        logRecv(synAck);
+        cid = synAck.cid; // use server-assigned connection ID
+        lastReceive = at;
+
+        // Options the server agreed to. A server that doesn't know about options
+        // answers with a plain SYN-ACK, which leaves everything off.
+        if (synAck.o && parseOptions(payload.data(), payload.size(), opts) == 0) {
+            if (cfg.log)
+                cerr << "Malformed SYN-ACK options, ignoring them" << endl;
+            opts = options_t();
+        }
+
+        // The server acknowledges as much of the data on the SYN as it took.
+        uint32_t earlyAccepted = 0;
+        if (synAck.ack > synHeader.seq + 1)
+            earlyAccepted = min(synAck.ack - (synHeader.seq + 1), earlySize);
+
+        if (opts.compress && packed != nullptr) {
+            src = packed;
+            if (cfg.log)
+                cerr << "Compressed " << stats.rawBytes << " bytes to " << stats.streamBytes << " bytes (ratio "
+                     << stats.ratio() << ", " << stats.storedBlocks << "/" << stats.blocks << " blocks stored raw)" << endl;
+        } else if (packed != nullptr) {
+            if (cfg.log)
+                cerr << "Server declined compression, sending raw." << endl;
+            if (earlyAccepted > 0) {
+                cerr << "ERROR: Server took compressed data without compression." << endl;
+                status = SenderState::ABORTED;
+                return;
+            }
+        }
+        if (opts.dedup && chunked != nullptr) {
+            src = chunked;
+            awaitingChunks = true;
+            if (cfg.log)
+                cerr << "Split " << raw.size() << " bytes into " << chunked->chunkCount() << " chunks, sending a "
+                     << chunked->manifestSize() << " byte manifest" << endl;
+        } else if (chunked != nullptr && cfg.log) {
+            cerr << "Server declined deduplication, sending the whole file." << endl;
+        }
+        fileSize = src->size();
+
+        if (opts.fecK > 0 && opts.fecM > 0) {
+            segmentSize = FEC_SEGMENT_SIZE;
+            if (cfg.log)
+                cerr << "FEC with groups of " << (int) opts.fecK << " segments and up to " << (int) opts.fecM
+                     << " parity packets" << endl;
+        } else if (cfg.wanted.fecK > 0 && cfg.log) {
+            cerr << "Server declined FEC." << endl;
+        }
+
+        // With a SYN cookie the server only sets the connection up once we ACK,
+        // and needs our options again to do so.
+        echoHeader = header_t { synHeader.seq + 1, synAck.seq + 1, cid, true, false, false };
+        echoHeader.o = true;
+        if (opts.cookie)
+            send(echoHeader, optBlock.data(), optBlock.size());
+
+        // Pick up where an earlier attempt at this transfer left off.
+        if (opts.resumed) {
+            sentBytes = transmittedBytes = min(opts.resumeOffset, fileSize);
+            if (transmittedBytes > 0 && cfg.log)
+                cerr << "Resuming at offset " << transmittedBytes << " of " << fileSize << endl;
+        } else if (cfg.wanted.resumeToken != 0 && cfg.log) {
+            cerr << "Server declined resuming, sending from the start." << endl;
+        }
+
+        // Data the server took with the SYN doesn't need to be sent again.
+        if (earlyAccepted > transmittedBytes)
+            sentBytes = transmittedBytes = earlyAccepted;
+        if (cfg.zeroRtt && cfg.log)
+            cerr << "Server took " << earlyAccepted << " of " << earlySize << " bytes sent with the SYN ("
+                 << raw.size() << " byte file)" << endl;
+
+        highestSent = firstOffset = roundEnd = sentBytes;
+        lastDelivery = at;
+        measuring = cfg.tuning.autoSize;
+        // Until there are samples, the handshake (from the first SYN, so it
+        // can only be too long) is the best guess at the RTT. A timer shorter
+        // than the RTT would retransmit everything and leave no samples.
+        if (measuring)
+            cfg.tuning.retransmissionTimer = min(cfg.tuning.timeoutTimer / 2,
+                                                 max(AUTO_MIN_RTO, 2 * millisBetween(synStart, at)));
+        seqStart = (synHeader.seq + 1) % MAX_SEQ_NUM;
+        currReceivedSeq = synAck.seq + 1;
+        status = SenderState::ESTABLISHED;
+        finishIfDone();
+    }
+
+    void onAck(const header_t& ackHeader, const string& payload, timestamp_t at) {
+        lastReceive = at;
+        logRecv(ackHeader);
+
+        // A late copy of the SYN-ACK, for a retransmitted SYN
+        if (ackHeader.s)
+            return;
+        if (ackHeader.o) {
+            if (awaitingChunks)
+                onAnswer(payload);
+            if (status != SenderState::ESTABLISHED)
+                return;
+        } else if (payload.size() == 2 && segmentSize == FEC_SEGMENT_SIZE) {
+            adaptFec((uint8_t) payload[0], (uint8_t) payload[1]);
+        }
+
+        receivedAck = ackHeader.ack;
+
+        // ACKs are cumulative: the server has everything before the byte it
+        // asks for. Work out how far past transmittedBytes that is, modulo
+        // the sequence number space; duplicate and stale ACKs move nothing.
+        uint32_t nextSeq = (seqStart + transmittedBytes) % MAX_SEQ_NUM;
+        uint32_t acked = (ackHeader.ack % MAX_SEQ_NUM + MAX_SEQ_NUM - nextSeq) % MAX_SEQ_NUM;
+        if (acked == 0 || acked > highestSent - transmittedBytes)
+            return;
+        transmittedBytes += acked;
+        sentBytes = max(sentBytes, transmittedBytes);
+
+        // Forget the packets this covers. The newest one that was only sent
+        // once gives an RTT sample; the receive timestamp keeps queueing
+        // delay on our side out of it.
+        auto it = packetInfo.begin();
+        auto sample = packetInfo.end();
+        while (it != packetInfo.end() && it->offset + it->size <= transmittedBytes) {
+            if (!it->retransmitted)
+                sample = it;
+            ++it;
+        }
+        if (sample != packetInfo.end()) {
+            double rtt = millisBetween(sample->time, at);
+            if (rttSamples++ == 0) {
+                srtt = rtt;
+                rttvar = rtt / 2;
+            } else {
+                rttvar = 0.75 * rttvar + 0.25 * abs(srtt - rtt);
+                srtt = 0.875 * srtt + 0.125 * rtt;
+            }
+            if (measuring)
+                measure(*sample, rtt, at);
+            if (cfg.tuning.autoSize)
+                adaptTimer();
+        }
+        packetInfo.erase(packetInfo.begin(), it);
+        lastDelivery = at;
+
+        // Adjust parameters for successful transmission of one packet, up to
+        // what both the window limit and the server allow
+        if (cwnd < ssThresh) {
+            cwnd += MAX_PAYLOAD_SIZE;
+        } else {
+            cwnd += MAX_PAYLOAD_SIZE * MAX_PAYLOAD_SIZE / cwnd;
+        }
+        cwnd = min(cwnd, min(cfg.tuning.maxCwnd, cfg.tuning.rwnd));
+        finishIfDone();
+    }
+
+    // Takes the delivery rate since sample was sent, and ends the
+    // measurement when a round trip ends without the rate growing enough.
+    void measure(const meta_t& sample, double rtt, timestamp_t at) {
+        double elapsed = millisBetween(sample.deliveredTime, at);
+        if (elapsed > 0)
+            maxRate = max(maxRate, (transmittedBytes - sample.delivered) / elapsed);
+        minRtt = minRtt == 0 ? rtt : min(minRtt, rtt);
+
+        if (transmittedBytes < roundEnd)
+            return;
+        roundEnd = highestSent;
+        if (maxRate >= plateauRate * 1.25) {
+            plateauRate = maxRate;
+            plateauRounds = 0;
+        } else if (++plateauRounds >= 3) {
+            finishMeasuring(true);
+        }
+    }
+
+    // With auto tuning the retransmission timer follows the RTT, with room
+    // for a bottleneck queue as long as the path itself.
+    void adaptTimer() {
+        auto& t = cfg.tuning;
+        t.retransmissionTimer = min(t.timeoutTimer / 2, max(AUTO_MIN_RTO, 2 * srtt + 4 * rttvar));
+    }
+
+    // Sizes the window to the bandwidth-delay product: slow start gives way
+    // to linear growth there, and a window that overshot it while doubling
+    // is cut back to twice the product to drain the bottleneck queue. It
+    // isn't a hard limit, as the share of a path measured once stops being
+    // right when other transfers come and go. The product is only a lower
+    // bound if the rate was still growing (a loss cut the measurement short)
+    // or it comes close to the largest window allowed (the window rather
+    // than the path held the rate back), and then the window is left alone.
+    void finishMeasuring(bool plateaued) {
+        measuring = false;
+        if (maxRate <= 0 || minRtt <= 0)
+            return;
+        auto& t = cfg.tuning;
+        bdp = max((uint32_t) (maxRate * minRtt), (uint32_t) MAX_PAYLOAD_SIZE);
+        bool lowerBound = !plateaued || bdp >= 0.8 * min(t.maxCwnd, t.rwnd);
+        if (!lowerBound) {
+            ssThresh = max(bdp, t.minCwnd);
+            cwnd = min(cwnd, max(2 * bdp, t.minCwnd));
+        }
+        if (cfg.log)
+            cerr << "Measured RTT " << minRtt << " ms and " << maxRate * 8 / 1000 << " Mbit/s, a " << bdp
+                 << " byte BDP" << (lowerBound ? " or more" : "") << ": window " << cwnd << " bytes, threshold "
+                 << ssThresh << " bytes, retransmission timer " << t.retransmissionTimer << " ms" << endl;
+    }
+
+    // The server's answer to the manifest: the stream goes on with the chunks
+    // it needs, if any.
+    void onAnswer(const string& payload) {
+        options_t answer;
+        chunk_ranges_t ranges;
+        if (parseOptions(payload.data(), payload.size(), answer) == 0 || !answer.answered)
+            return;
+        if (!parseRanges(answer.missingChunks, chunked->chunkCount(), ranges)) {
+            cerr << "ERROR: Malformed list of missing chunks." << endl;
+            status = SenderState::ABORTED;
+            return;
+        }
+
+        chunked->select(ranges);
+        fileSize = src->size();
+        awaitingChunks = false;
+        if (cfg.log)
+            cerr << "Server needs " << chunked->selectedCount() << " of " << chunked->chunkCount() << " chunks ("
+                 << chunked->selectedSize() << " of " << raw.size() << " bytes)" << endl;
+        finishIfDone();
+    }
+
+    // Sends a total of cwnd bytes past the last acknowledged one.
+    void sendWindow() {
+        while (status == SenderState::ESTABLISHED && transmittedBytes + cwnd > sentBytes && sentBytes < fileSize) {
+            // Expected payload size is either max UDP payload size or the remaining cwnd quota
+            uint32_t expected = min(segmentSize, transmittedBytes + cwnd - sentBytes);
+
+            // ACKs arrive one by one, so wait for the window to fit a full
+            // packet rather than sending slivers of it.
+            if (expected < segmentSize && expected < fileSize - sentBytes)
+                break;
+
+            // The payload might be smaller than expected at the end of the stream.
+            char payload[MAX_PAYLOAD_SIZE];
+            uint32_t size = src->read(sentBytes, payload, expected);
+            if (size == 0) {
+                cerr << "ERROR: Failed to read from file." << endl;
+                status = SenderState::ABORTED;
+                return;
+            }
+
+            header_t header {
+                (seqStart + sentBytes) % MAX_SEQ_NUM,
+                currReceivedSeq,
+                cid,
+                false, false, false
+            };
+            // The first data packet completes the handshake. Until the server
+            // acknowledges something, its retransmissions have to as well.
+            if (sentBytes == firstOffset && receivedAck == 0)
+                header.a = true;
+
+            // The send time is taken first, as the ACK may be stamped before
+            // the send returns.
+            meta_t meta { sentBytes, size, header.seq, header.seq + size, clock.now(), sentBytes < highestSent,
+                          transmittedBytes, lastDelivery };
+            send(header, payload, size);
+            packetInfo.push_back(meta);
+
+            // Only new segments are protected; retransmissions repeat one.
+            if (segmentSize == FEC_SEGMENT_SIZE && sentBytes == highestSent)
+                addToGroup(header.seq, payload, size, sentBytes + size == fileSize);
+
+            sentBytes += size;
+            highestSent = max(highestSent, sentBytes);
+        }
+    }
+
+    // Collects new segments and sends the group's parity once it has
+    // opts.fecK of them, or at the end of the stream.
+    void addToGroup(uint32_t seq, const char* payload, uint32_t size, bool last) {
+        if (group.empty())
+            groupSeq = seq;
+        group.push_back(string(payload, size));
+        if ((int) group.size() < opts.fecK && !last)
+            return;
+
+        fec_header_t fh { (uint8_t) group.size(), (uint8_t) fecM, 0, (uint16_t) group.back().size() };
+        size_t paritySize = group.size() == 1 ? group[0].size() : FEC_SEGMENT_SIZE;
+        header_t header { groupSeq, currReceivedSeq, cid, false, false, false };
+        header.p = true;
+        for (int row = 0; row < fecM; row++) {
+            char packet[MAX_PAYLOAD_SIZE];
+            fh.row = row;
+            size_t at = formatFecHeader(packet, fh);
+            string parity = fecEncode(group, fecM, row, paritySize);
+            memcpy(packet + at, parity.data(), parity.size());
+            send(header, packet, at + parity.size());
+            paritySent++;
+        }
+        group.clear();
+    }
+
+    // Sizes the parity to about twice the segments a group is expected to
+    // lose, from the server's reports of lost segments per group.
+    void adaptFec(uint8_t lost, uint8_t k) {
+        if (k == 0 || lost > k)
+            return;
+        fecLoss = 0.875 * fecLoss + 0.125 * lost / k;
+        fecM = max(1, min((int) opts.fecM, (int) ceil(2 * fecLoss * opts.fecK)));
+    }
+
+    // Only the oldest unacknowledged packet can time out; everything after
+    // it is sent again anyway.
+    void checkTimeout(timestamp_t now) {
+        if (packetInfo.empty() || millisBetween(packetInfo.front().time, now) < cfg.tuning.retransmissionTimer)
+            return;
+
+        if (measuring)
+            finishMeasuring(plateauRounds > 0);
+        // A timer that follows the RTT backs off until the next sample, as
+        // the RTT may just have grown past it.
+        if (cfg.tuning.autoSize)
+            cfg.tuning.retransmissionTimer = min(cfg.tuning.timeoutTimer / 2, 2 * cfg.tuning.retransmissionTimer);
+        auto& oldest = packetInfo.front();
+        sentBytes = oldest.offset;
+        ssThresh = cwnd / 2;
+        cwnd = cfg.tuning.minCwnd;
+        timeoutCount++;
+        if (cfg.log)
+            cout << "Retransmitting from \n" << sentBytes << " seq: " << oldest.seq << endl;
+        packetInfo.clear();
+
+        // Nothing acknowledged yet, so the cookie ACK may have been lost too.
+        if (opts.cookie && receivedAck == 0)
+            send(echoHeader, optBlock.data(), optBlock.size());
+    }
+
+    // Once everything is acknowledged, start disconnecting.
+    void finishIfDone() {
+        if (status != SenderState::ESTABLISHED || transmittedBytes < fileSize || awaitingChunks)
+            return;
+        if (cfg.log && rttSamples > 0)
+            cerr << "RTT " << srtt << " ms (variation " << rttvar << " ms, " << rttSamples << " samples)" << endl;
+        if (cfg.log && paritySent > 0)
+            cerr << "Sent " << paritySent << " parity packets, " << fecM << " per group at the end (loss estimate "
+                 << fecLoss << ")" << endl;
+        status = SenderState::CLOSING;
+        finStart = clock.now();
+        sendFin();
+    }
+};
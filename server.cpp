@@ -14,42 +14,87 @@
 #include <dirent.h>
 #include <chrono>
 
-#include <unordered_map>
-
-#include "protocol.hpp"
-#include "connection.hpp"
+#include "io.hpp"
+#include "receiver.hpp"
+#include "tuning.hpp"
+#include "udpstats.hpp"
 
 using namespace std;
 
-int sock;
+// Set by SIGQUIT and SIGTERM. The handler only records the signal; the main
+// loop notices it within a receive timeout and shuts down from there, since
+// writing out files isn't safe inside a handler.
+volatile sig_atomic_t stopRequested = 0;
 
-unordered_map<uint16_t, Connection> connections;
-unordered_map<uint16_t, std::chrono::steady_clock::time_point> lastPacketTimes;
-uint16_t connCnt = 1;
+// Set by SIGUSR1, which asks for the stats file to be written.
+volatile sig_atomic_t statsRequested = 0;
 
 void signalHandler(int sig) {
-    // todo: clean up, graceful exit.
-    close(sock);
+    stopRequested = 1;
+}
 
-    // exit with code zero, as specified by the spec.
-    exit(0);
+void statsHandler(int sig) {
+    statsRequested = 1;
+}
+
+void writeStats(const string& path, const Receiver& receiver, uint16_t port) {
+    server_stats_t stats;
+    stats.drops = receiver.drops;
+    stats.socketDrops = readSocketDrops(port);
+    if (!writeServerStats(path, stats))
+        cerr << "Failed to write stats to " << path << endl;
 }
 
 int main(int argc, const char * argv[]) {
     cout << "Hi, welcome to this dysfunctional udp server" << endl;
-    int portNumber;
+    int portNumber, sock;
     struct sockaddr_in socketAddress;
     char buffer[1024];
     ssize_t recsize;
     socklen_t fromlen;
+    bool directIO = false;
+    bool synCookies = false;
+    string statsPath;
+    tuning_t tuning;
     
     // Validate cml arguments. Port number needs to be postive integer.
     // Destination directory is guaranteed to be correct.
     
-    if (argc != 3) {
+    if (argc < 3) {
         std::cerr << "ERROR: Invalid number of arguments. Need port number and destination directory.";
         exit(1);
     }
+
+    for (int i = 3; i < argc; i++) {
+        string flag(argv[i]);
+        if (parseTuningFlag(argc, argv, i, tuning)) {
+            // --profile NAME or --config FILE, see tuning.hpp
+            continue;
+        } else if (flag == "--direct") {
+            // Write received files with O_DIRECT instead of through the page cache.
+            directIO = true;
+        } else if (flag == "--syn-cookies") {
+            // Keep no state for a SYN until the client answers the SYN-ACK.
+            synCookies = true;
+        } else if (flag == "--stats" && i + 1 < argc) {
+            // Write the drop counters to this file on SIGUSR1 and on exit.
+            statsPath = argv[++i];
+        } else {
+            std::cerr << "ERROR: Unknown option " << flag << endl;
+            exit(1);
+        }
+    }
+
+    string tuningError;
+    if (!checkTuning(tuning, tuningError)) {
+        std::cerr << "ERROR: " << tuningError << endl;
+        exit(1);
+    }
+    // The server has no round trips of its own to measure.
+    if (tuning.autoSize) {
+        std::cerr << "ERROR: Auto tuning only applies to the client" << endl;
+        exit(1);
+    }
     
     try {
         portNumber = std::stoi(argv[1]);
@@ -66,6 +111,7 @@ int main(int argc, const char * argv[]) {
     
     signal(SIGQUIT, signalHandler);
     signal(SIGTERM, signalHandler);
+    signal(SIGUSR1, statsHandler);
     
     // Initial like socket, bind, and receive.
     
@@ -87,8 +133,23 @@ int main(int argc, const char * argv[]) {
     read_timeout.tv_sec = 0;
     read_timeout.tv_usec = 10;
     setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &read_timeout, sizeof read_timeout);
+    setSocketBuffers(sock, tuning.sndBuf, tuning.rcvBuf);
+
+    SystemClock clock;
+    UdpSocket io(sock);
+    Receiver receiver(clock, io, argv[2]);
+    receiver.directIO = directIO;
+    receiver.synCookies = synCookies;
+    receiver.tuning = tuning;
+
+    while (!stopRequested) {
+        receiver.tick();
+        if (statsRequested) {
+            statsRequested = 0;
+            if (!statsPath.empty())
+                writeStats(statsPath, receiver, portNumber);
+        }
 
-    for (;;) {
         struct sockaddr sender;
         recsize = recvfrom(sock, (void*)buffer, sizeof buffer, 0, &sender, &fromlen);
         if (recsize < 0) {
@@ -97,198 +158,14 @@ int main(int argc, const char * argv[]) {
 //            exit(1);
             continue;
         }
+        receiver.onPacket(buffer, recsize, sender);
+    }
 
-        auto header = getHeader(buffer, recsize);
-        if ((header.cid != 0 && connections.find(header.cid) == connections.end()) || (header.cid != 0 && !header.a && connections[header.cid].state == CState::ENDED)) {
-            cout << "DROP " << header.seq << " " << header.ack << " " << header.cid;
-            if (header.a) 
-                cout << " ACK";
-            if (header.s)
-                cout << " SYN";
-            if (header.f)
-                cout << " FIN";
-            cout << endl; 
-            continue;
-        }
-        logServerRecv(header);
-        auto payload = getPayload(buffer, recsize);
-        
-        // Determine if the last packet was sent over 10 seconds ago. If so, change CState to ended and write ERROR to
-        // corresponding file.
-        if (lastPacketTimes.find(header.cid) != lastPacketTimes.end()) {
-            std::chrono::steady_clock::time_point current = std::chrono::steady_clock::now();
-            if (std::chrono::duration_cast<std::chrono::milliseconds>(current - lastPacketTimes[header.cid]).count() > 10000) {
-                connections[header.cid].state = CState::ENDED;
-                string payload {"ERROR"};
-                cout << "Connection timeout." << endl;
-                
-                if (connections[header.cid].file == nullptr) {
-                    std::cerr << "File ptr is null when trying to write ERROR from time out!" << endl;
-                }
-                else if (fwrite(payload.c_str(), 1, payload.size(), connections[header.cid].file) < 0) {
-                    std::cerr << "Failed to write to file for a closed connection due to timeout." << endl;
-                }
-                fflush(connections[header.cid].file);
-                                
-            } else {
-                // If no timeout, update the last packet received time.
-                lastPacketTimes[header.cid] = std::chrono::steady_clock::now();
-            }
-        } else {
-            // Create the entry if not present.
-            lastPacketTimes[header.cid] = std::chrono::steady_clock::now();
-        }
-
-        if (header.s) {
-            // cout << "Received handshake request" << endl;
-            // After receiving a packet with SYN flag, the server should create state for the connection ID and proceed with 3-way handshake for this connection. Server should use 4321 as initial sequence number.
-            header_t resHeader {
-                4321,
-                header.seq + 1,
-                connCnt,
-                true, true, false
-            };
-            // Create new connection with unique id
-            connections.emplace(connCnt, Connection { connCnt, sender });
-
-            char sendBuffer[1024];
-            auto packetSize = formatSendPacket(sendBuffer, resHeader, nullptr, 0);
-
-            sendto(sock, sendBuffer, packetSize, 0, &sender, sizeof sender);
-            logServerSend(resHeader);
-            
-            connCnt += 1;
-            continue;
-        }
-
-        if (header.a) {
-            // Client ack
-            // cout << "Received client " << header.cid << " ack" << endl;
-            if (connections.find(header.cid) == connections.end()) {
-                // Invalid header cid, not found in connections
-                cerr << "Invalid header cid, not found in connections" << endl;
-                continue;
-            }
-            auto& conn = connections[header.cid];
-            if (conn.state == CState::ENDED) {
-                // Finish up the connection
-                fclose(conn.file);
-                // cout << "Connection closed." << endl;
-                continue;
-            }
-            if (conn.state == CState::ACK) {
-                conn.state = CState::STARTED;
-                auto path = string(argv[2]) + "/" + to_string(header.cid) + ".file";
-                // cout << "Saving to path: " << path << endl;
-                auto fptr = fopen(path.c_str(), "wb");
-                conn.file = fptr;
-                // cout << "Init fptr: " << fptr << endl;
-            }
-
-        }
-
-        // After receiving a FIN, send an ACK and FIN back to back (but not closing the socket).
-        if (header.f) {
-            // cout << "Received Fin request" << endl;
-            
-            // Only responds to a FIN when its sent by a valid, still open connection.
-            // If not, disregard it.
-            if (connections.find(header.cid) == connections.end()) {
-                cerr << "Invalid header cid, not found in connections" << endl;
-                continue;
-            }
-            
-            auto& conn = connections[header.cid];
-            if (conn.state == CState::ENDED) {
-                continue;
-            }
-            
-            header_t ackHeader {
-                4322,
-                header.seq + 1,
-                header.cid,
-                true, false, true
-            };
-
-            char sendBuffer[1024];
-            auto packetSize = formatSendPacket(sendBuffer, ackHeader, nullptr, 0);
-            sendto(sock, sendBuffer, packetSize, 0, &sender, sizeof sender);
-            logServerSend(ackHeader);
-
-            // Now change the status of this connection to ended.
-            connections[header.cid].state = CState::ENDED;
-            
-            continue;
-        }
-
-        if (connections.find(header.cid) != connections.end()) {
-            // Received packet
-            auto& conn = connections[header.cid];
-
-            if (conn.state == CState::STARTED) {
-                // Connection handshake is appropriate
-                
-                // Check if file ptr is nullptr, if so wait for ack first.
-                if (conn.head == header.seq) {
-                    conn.head += payload.size();
-                    if (conn.head > MAX_SEQ_NUM) {
-                        conn.head = conn.head % MAX_SEQ_NUM;
-                        conn.wrap++;
-                    }
-                    // If this packet is the next seq expected
-                    // cout << "Fptr here: " << conn.file << endl;
-                    if (connections[header.cid].file == nullptr) {
-                        std::cerr << "File ptr is nullptr when trying to write to file cid=" << conn.cid << " packet queue!" << endl;
-                    } else if (fwrite(payload.c_str(), 1, payload.size(), conn.file) < 0) {
-                        perror("Write failed");
-                        // TODO : handle error
-                    }
-                    fflush(conn.file);
-                } else {
-                    conn.queue.emplace(header.seq, DataPacket { header.seq, (uint32_t) payload.size(), payload });
-                }
-
-                // Check if out-of-order packets in the queue can now be written
-                for (auto& packet: conn.queue) {
-                    if (packet.first == conn.head) {
-                        if (conn.file == nullptr) {
-                            std::cerr << "File ptr is nullptr when trying to process cid=" << conn.cid << " packet queue!" << endl;
-                        } else if (fwrite(packet.second.payload.c_str(), 1, payload.size(), conn.file) < 0) {
-                            perror("Write failed");
-                            // TODO : handle error
-                        }
-                        fflush(conn.file);
-                        conn.head += packet.second.size;
-                        if (conn.head > 102401) {
-                            conn.head = conn.head % 102401;
-                            conn.wrap++;
-                        }
-                    }
-                }
-
-                // cout << "Queue size: " << conn.queue.size() << endl;
-                // cout << conn.head << " " << conn.queue.begin()->first << endl;
-
-                // Send ACK
-                header_t resHeader {
-                    4322,
-                    // header.seq + (uint32_t) payload.size(),
-                    conn.head,
-                    conn.cid,
-                    true, false, false
-                };
-
-                char sendBuffer[1024];
-                auto packetSize = formatSendPacket(sendBuffer, resHeader, nullptr, 0);
-
-                sendto(sock, sendBuffer, packetSize, 0, &sender, sizeof sender);
-                logServerSend(resHeader);
-            } else if (conn.state == CState::ENDED) {
+    if (!statsPath.empty())
+        writeStats(statsPath, receiver, portNumber);
+    close(sock);
+    receiver.shutdown();
 
-                
-            }
-        } 
-    }
-    
+    // exit with code zero, as specified by the spec.
     return 0;
 }
@@ -0,0 +1,434 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <map>
+#include <queue>
+#include <random>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "io.hpp"
+#include "receiver.hpp"
+#include "sender.hpp"
+#include "tuning.hpp"
+
+using namespace std;
+
+// Discrete-event simulator: runs many transfers between Sender and Receiver
+// over simulated links in virtual time. All clients share one bottleneck link
+// to the server and one back, each with a rate, a drop-tail queue, a
+// propagation delay and random loss. Runs are deterministic for a seed.
+
+struct sim_config_t {
+    int transfers = 1000;
+    uint32_t minSize = 20000;
+    uint32_t maxSize = 20000;
+    double arrivalRate = 200;  // transfers started per second, 0 = all at once
+    double bandwidth = 50;     // Mbit/s each way
+    double delay = 20;         // one-way propagation delay in ms
+    double loss = 0.01;        // chance each packet is lost
+    uint32_t queue = 128 * 1024; // bytes the bottleneck queues before dropping
+    uint64_t seed = 1;
+    uint8_t fecK = 0, fecM = 0; // forward error correction, off by default
+    tuning_t tuning;            // used by both ends
+    bool log = false;
+};
+
+class SimClock : public Clock {
+public:
+    int64_t nanos = 0;
+
+    timestamp_t now() override {
+        return timestamp_t(chrono::nanoseconds(nanos));
+    }
+};
+
+// A link sends one packet at a time at its rate. Packets that arrive while
+// it is busy wait in its queue, or are dropped when the queue is full.
+struct Link {
+    double bytesPerNano;
+    int64_t delay;
+    double loss;
+    uint32_t queueLimit;
+
+    int64_t busyUntil = 0;
+    int64_t busyTime = 0;
+    uint64_t packets = 0, queueDrops = 0, lost = 0;
+
+    Link(double mbits, double delayMillis, double loss, uint32_t queueLimit):
+        bytesPerNano(mbits * 1e6 / 8 / 1e9), delay((int64_t) (delayMillis * 1e6)), loss(loss), queueLimit(queueLimit) {}
+
+    // Returns when the packet arrives at the other end, or -1 if it doesn't.
+    int64_t transmit(int64_t now, size_t size, mt19937_64& rng) {
+        packets++;
+        int64_t start = max(now, busyUntil);
+        if ((start - now) * bytesPerNano + size > queueLimit) {
+            queueDrops++;
+            return -1;
+        }
+        int64_t duration = (int64_t) ceil(size / bytesPerNano);
+        busyUntil = start + duration;
+        busyTime += duration;
+        if (uniform_real_distribution<double>(0, 1)(rng) < loss) {
+            lost++;
+            return -1;
+        }
+        return busyUntil + delay;
+    }
+};
+
+struct received_t {
+    uint64_t bytes;
+    uint64_t hash;
+};
+
+// Takes the place of the disk: keeps a hash of what was written, reported
+// by final path once the file is finished.
+class SinkStorage : public Storage {
+public:
+    explicit SinkStorage(map<string, received_t>& results): results(results) {}
+
+    bool open(const string& path, uint64_t offset, uint64_t size) override {
+        bytes = offset;
+        hash = FNV_OFFSET;
+        return true;
+    }
+
+    bool write(const char* data, size_t size) override {
+        hash = fnv1a(hash, data, size);
+        bytes += size;
+        return true;
+    }
+
+    bool sync() override { return true; }
+    bool close() override { return true; }
+    void abandon() override {}
+    uint64_t offset() const override { return bytes; }
+
+    bool finish(const string& path, const string& finalPath) override {
+        results[finalPath] = received_t { bytes, hash };
+        return true;
+    }
+
+private:
+    map<string, received_t>& results;
+    uint64_t bytes = 0;
+    uint64_t hash = FNV_OFFSET;
+};
+
+class Simulator {
+public:
+    explicit Simulator(const sim_config_t& cfg):
+        cfg(cfg), rng(cfg.seed), serverIO(*this), receiver(clock, serverIO, "sim"),
+        up(cfg.bandwidth, cfg.delay, cfg.loss, cfg.queue), down(cfg.bandwidth, cfg.delay, cfg.loss, cfg.queue) {
+        receiver.log = cfg.log;
+        receiver.tuning = cfg.tuning;
+        receiver.storageFactory = [this]() { return unique_ptr<Storage>(new SinkStorage(results)); };
+        serverAddr = address(0);
+
+        uniform_int_distribution<uint32_t> sizes(cfg.minSize, cfg.maxSize);
+        exponential_distribution<double> gaps(cfg.arrivalRate > 0 ? cfg.arrivalRate : 1);
+        double start = 0;
+        flows.resize(cfg.transfers);
+        for (int i = 0; i < cfg.transfers; i++) {
+            auto& flow = flows[i];
+            flow.io.sim = this;
+            flow.io.node = i;
+            flow.source.reset(new SyntheticSource(sizes(rng), cfg.seed * 1000003 + i));
+            flow.expected = flow.source->hash();
+
+            sender_config_t scfg;
+            scfg.wanted.fileSize = flow.source->size();
+            scfg.wanted.fecK = cfg.fecK;
+            scfg.wanted.fecM = cfg.fecM;
+            scfg.negotiate = true;
+            scfg.log = cfg.log;
+            scfg.tuning = cfg.tuning;
+            flow.sender.reset(new Sender(clock, flow.io, serverAddr, *flow.source, nullptr, scfg));
+
+            if (cfg.arrivalRate > 0 && i > 0)
+                start += gaps(rng);
+            flow.start = (int64_t) (start * 1e9);
+            schedule(flow.start, START, i);
+        }
+        schedule(0, TICK, -1);
+    }
+
+    void run() {
+        while (!events.empty() && (running > 0 || started < flows.size())) {
+            auto event = events.top();
+            events.pop();
+            clock.nanos = event.time;
+
+            if (event.kind == TICK) {
+                receiver.tick();
+                schedule(event.time + TICK_INTERVAL, TICK, -1);
+            } else if (event.kind == TO_SERVER) {
+                receiver.onPacket(event.packet.data(), event.packet.size(), address(event.node + 1));
+            } else {
+                auto& flow = flows[event.node];
+                if (event.kind == START) {
+                    started++;
+                    running++;
+                    flow.sender->start();
+                } else if (event.kind == TO_CLIENT) {
+                    char* buf = (char*) event.packet.data();
+                    flow.sender->onPacket(getHeader(buf, event.packet.size()), getPayload(buf, event.packet.size()), clock.now());
+                } else if (event.time != flow.timer) {
+                    continue; // superseded by an earlier timer
+                } else {
+                    flow.timer = NEVER;
+                }
+                flow.sender->poll();
+                update(flow);
+            }
+        }
+    }
+
+    int report(double wallSeconds) {
+        int completed = 0, failed = 0, corrupt = 0;
+        uint64_t bytes = 0;
+        uint32_t timeouts = 0, parity = 0;
+        int64_t end = 0;
+        vector<double> times, rates;
+        for (auto& flow: flows) {
+            timeouts += flow.sender->timeouts();
+            parity += flow.sender->parityPackets();
+            if (flow.finish < 0) {
+                failed++;
+                continue;
+            }
+            auto got = results.find(receiver.finalPath(flow.sender->connectionId()));
+            if (got == results.end() || got->second.bytes != flow.source->size() || got->second.hash != flow.expected) {
+                corrupt++;
+                continue;
+            }
+            completed++;
+            bytes += flow.source->size();
+            end = max(end, flow.finish);
+            double seconds = (flow.finish - flow.start) / 1e9;
+            times.push_back(seconds);
+            rates.push_back(flow.source->size() / seconds);
+        }
+
+        // Jain's fairness index: 1 when all flows got the same throughput.
+        double sum = 0, squares = 0;
+        for (double r: rates) {
+            sum += r;
+            squares += r * r;
+        }
+        double fairness = rates.empty() ? 0 : sum * sum / (rates.size() * squares);
+        sort(times.begin(), times.end());
+        double virtualSeconds = clock.nanos / 1e9;
+
+        cout << "transfers    " << flows.size() << " (" << completed << " completed, " << failed << " failed, "
+             << corrupt << " corrupt)" << endl;
+        cout << "virtual time " << virtualSeconds << " s, wall time " << wallSeconds << " s ("
+             << virtualSeconds / max(wallSeconds, 1e-9) << "x real time)" << endl;
+        cout << "goodput      " << (end > 0 ? bytes * 8 / (end / 1e9) / 1e6 : 0) << " Mbit/s of "
+             << cfg.bandwidth << " Mbit/s" << endl;
+        cout << "completion   p50 " << percentile(times, 0.5) << " s, p99 " << percentile(times, 0.99)
+             << " s, max " << (times.empty() ? 0 : times.back()) << " s" << endl;
+        cout << "fairness     " << fairness << " (Jain's index over per-transfer throughput)" << endl;
+        cout << "timeouts     " << timeouts << " (" << cfg.tuning.profile << " profile)" << endl;
+        if (cfg.fecK > 0)
+            cout << "fec          " << parity << " parity packets" << endl;
+        printLink("uplink  ", up, clock.nanos);
+        printLink("downlink", down, clock.nanos);
+        return failed == 0 && corrupt == 0 ? 0 : 1;
+    }
+
+private:
+    enum { START, TIMER, TO_CLIENT, TO_SERVER, TICK };
+    static const int64_t NEVER = INT64_MAX;
+    static const int64_t TICK_INTERVAL = 250 * 1000 * 1000;
+
+    struct event_t {
+        int64_t time;
+        uint64_t order; // keeps events at the same time in the order they were made
+        int kind;
+        int node;
+        string packet;
+
+        bool operator>(const event_t& other) const {
+            return time != other.time ? time > other.time : order > other.order;
+        }
+    };
+
+    struct ClientIO : public PacketIO {
+        Simulator* sim;
+        int node;
+
+        void send(const char* packet, size_t size, const sockaddr& to) override {
+            sim->transmit(sim->up, TO_SERVER, node, packet, size);
+        }
+    };
+
+    struct ServerIO : public PacketIO {
+        Simulator& sim;
+
+        explicit ServerIO(Simulator& sim): sim(sim) {}
+
+        void send(const char* packet, size_t size, const sockaddr& to) override {
+            auto in = (const sockaddr_in*) &to;
+            sim.transmit(sim.down, TO_CLIENT, ntohl(in->sin_addr.s_addr) - ntohl(inet_addr("10.0.0.1")) - 1, packet, size);
+        }
+    };
+
+    struct flow_t {
+        ClientIO io;
+        unique_ptr<SyntheticSource> source;
+        unique_ptr<Sender> sender;
+        uint64_t expected = 0;
+        int64_t start = 0;
+        int64_t finish = -1; // when everything was acknowledged
+        int64_t timer = NEVER;
+        bool done = false;
+    };
+
+    sim_config_t cfg;
+    mt19937_64 rng;
+    SimClock clock;
+    ServerIO serverIO;
+    Receiver receiver;
+    sockaddr serverAddr;
+    Link up, down;
+    map<string, received_t> results;
+    vector<flow_t> flows;
+    size_t started = 0;
+    size_t running = 0;
+
+    priority_queue<event_t, vector<event_t>, greater<event_t>> events;
+    uint64_t order = 0;
+
+    void schedule(int64_t time, int kind, int node, string packet = string()) {
+        events.push(event_t { time, order++, kind, node, std::move(packet) });
+    }
+
+    void transmit(Link& link, int kind, int node, const char* packet, size_t size) {
+        int64_t arrival = link.transmit(clock.nanos, size, rng);
+        if (arrival >= 0)
+            schedule(arrival, kind, node, string(packet, size));
+    }
+
+    // Notes progress and makes sure the sender is polled by its deadline.
+    void update(flow_t& flow) {
+        auto state = flow.sender->state();
+        if (flow.finish < 0 && state != SenderState::SYN_SENT && state != SenderState::ESTABLISHED &&
+            state != SenderState::ABORTED)
+            flow.finish = clock.nanos;
+        if (flow.sender->done()) {
+            if (!flow.done)
+                running--;
+            flow.done = true;
+            return;
+        }
+
+        auto deadline = flow.sender->deadline();
+        int64_t at = chrono::duration_cast<chrono::nanoseconds>(deadline.time_since_epoch()).count();
+        if (at < flow.timer) {
+            flow.timer = at;
+            schedule(at, TIMER, &flow - flows.data());
+        }
+    }
+
+    // Server is 10.0.0.1, client i is 10.0.0.1 + i + 1.
+    static sockaddr address(uint32_t node) {
+        sockaddr_in in;
+        memset(&in, 0, sizeof in);
+        in.sin_family = AF_INET;
+        in.sin_addr.s_addr = htonl(ntohl(inet_addr("10.0.0.1")) + node);
+        in.sin_port = htons(5000);
+        return (sockaddr&) in;
+    }
+
+    static double percentile(const vector<double>& sorted, double p) {
+        if (sorted.empty())
+            return 0;
+        return sorted[min(sorted.size() - 1, (size_t) (p * sorted.size()))];
+    }
+
+    static void printLink(const char* name, const Link& link, int64_t nanos) {
+        cout << name << "     " << link.packets << " packets, " << link.queueDrops << " queue drops, " << link.lost
+             << " lost, " << 100.0 * link.busyTime / max(nanos, (int64_t) 1) << "% busy" << endl;
+    }
+};
+
+int main(int argc, const char * argv[]) {
+    sim_config_t cfg;
+
+    for (int i = 1; i < argc; i++) {
+        string flag(argv[i]);
+        if (flag == "--log") {
+            cfg.log = true;
+            continue;
+        }
+        // --profile NAME or --config FILE, see tuning.hpp
+        if (parseTuningFlag(argc, argv, i, cfg.tuning))
+            continue;
+        if (i + 1 >= argc) {
+            std::cerr << "ERROR: Missing value for " << flag << endl;
+            exit(1);
+        }
+        string value(argv[++i]);
+        try {
+            if (flag == "--transfers") {
+                cfg.transfers = stoi(value);
+            } else if (flag == "--size") {
+                // A fixed size, or MIN-MAX for sizes uniformly in between
+                auto dash = value.find('-');
+                cfg.minSize = stoul(value.substr(0, dash));
+                cfg.maxSize = dash == string::npos ? cfg.minSize : stoul(value.substr(dash + 1));
+            } else if (flag == "--arrival-rate") {
+                cfg.arrivalRate = stod(value);
+            } else if (flag == "--bandwidth") {
+                cfg.bandwidth = stod(value);
+            } else if (flag == "--delay") {
+                cfg.delay = stod(value);
+            } else if (flag == "--loss") {
+                cfg.loss = stod(value);
+            } else if (flag == "--queue") {
+                cfg.queue = stoul(value);
+            } else if (flag == "--seed") {
+                cfg.seed = stoull(value);
+            } else if (flag == "--fec") {
+                // K+M: up to M parity packets per K data segments
+                auto plus = value.find('+');
+                int k = stoi(value.substr(0, plus));
+                int m = plus == string::npos ? 0 : stoi(value.substr(plus + 1));
+                if (k <= 0 || m <= 0 || k > FEC_MAX_K || m > FEC_MAX_M)
+                    throw invalid_argument(value);
+                cfg.fecK = k;
+                cfg.fecM = m;
+            } else {
+                std::cerr << "ERROR: Unknown option " << flag << endl;
+                exit(1);
+            }
+        } catch (std::exception const &e) {
+            std::cerr << "ERROR: Invalid value for " << flag << ": " << value << endl;
+            exit(1);
+        }
+    }
+
+    if (cfg.transfers <= 0 || cfg.transfers > 60000 || cfg.minSize > cfg.maxSize || cfg.bandwidth <= 0 || cfg.queue == 0) {
+        std::cerr << "ERROR: Invalid simulation parameters." << endl;
+        exit(1);
+    }
+    string tuningError;
+    if (!checkTuning(cfg.tuning, tuningError)) {
+        std::cerr << "ERROR: " << tuningError << endl;
+        exit(1);
+    }
+
+    auto wallStart = chrono::steady_clock::now();
+    Simulator sim(cfg);
+    sim.run();
+    return sim.report(chrono::duration<double>(chrono::steady_clock::now() - wallStart).count());
+}
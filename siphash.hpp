@@ -0,0 +1,58 @@
+#include <stdint.h>
+#include <string.h>
+
+#pragma once
+
+// SipHash-2-4 (Aumasson and Bernstein), a keyed hash for authenticating short
+// inputs such as SYN cookies. Unlike a plain hash mixed with a secret, seeing
+// its outputs doesn't help forge another one.
+
+uint64_t sipRotate(uint64_t x, int b) {
+    return (x << b) | (x >> (64 - b));
+}
+
+void sipRound(uint64_t& v0, uint64_t& v1, uint64_t& v2, uint64_t& v3) {
+    v0 += v1; v1 = sipRotate(v1, 13); v1 ^= v0; v0 = sipRotate(v0, 32);
+    v2 += v3; v3 = sipRotate(v3, 16); v3 ^= v2;
+    v0 += v3; v3 = sipRotate(v3, 21); v3 ^= v0;
+    v2 += v1; v1 = sipRotate(v1, 17); v1 ^= v2; v2 = sipRotate(v2, 32);
+}
+
+// Reads 8 bytes little endian.
+uint64_t sipWord(const unsigned char* p) {
+    uint64_t word = 0;
+    for (int i = 7; i >= 0; i--)
+        word = (word << 8) | p[i];
+    return word;
+}
+
+uint64_t siphash24(const uint64_t key[2], const void* data, size_t size) {
+    uint64_t v0 = key[0] ^ 0x736f6d6570736575ull;
+    uint64_t v1 = key[1] ^ 0x646f72616e646f6dull;
+    uint64_t v2 = key[0] ^ 0x6c7967656e657261ull;
+    uint64_t v3 = key[1] ^ 0x7465646279746573ull;
+
+    auto p = (const unsigned char*) data;
+    size_t whole = size - size % 8;
+    for (size_t i = 0; i < whole; i += 8) {
+        uint64_t m = sipWord(p + i);
+        v3 ^= m;
+        sipRound(v0, v1, v2, v3);
+        sipRound(v0, v1, v2, v3);
+        v0 ^= m;
+    }
+
+    // The last word holds the remaining bytes and the length.
+    unsigned char tail[8] = {};
+    memcpy(tail, p + whole, size - whole);
+    uint64_t m = sipWord(tail) | ((uint64_t) size << 56);
+    v3 ^= m;
+    sipRound(v0, v1, v2, v3);
+    sipRound(v0, v1, v2, v3);
+    v0 ^= m;
+
+    v2 ^= 0xff;
+    for (int i = 0; i < 4; i++)
+        sipRound(v0, v1, v2, v3);
+    return v0 ^ v1 ^ v2 ^ v3;
+}
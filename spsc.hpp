@@ -0,0 +1,57 @@
+#include <stdlib.h>
+#include <atomic>
+
+#pragma once
+
+using namespace std;
+
+// Bounded lock-free queue for exactly one producer thread and one consumer
+// thread. Each side owns one index and only reads the other's, caching it so
+// the shared cache line is touched only when the queue looks full or empty.
+template <typename T, size_t N>
+class SpscQueue {
+    static_assert(N > 0 && (N & (N - 1)) == 0, "capacity must be a power of two");
+
+public:
+    SpscQueue(): head(0), tailCache(0), tail(0), headCache(0) {}
+
+    // Producer side. Returns false if the queue is full.
+    bool push(const T& item) {
+        size_t t = tail.load(memory_order_relaxed);
+        if (t - headCache == N) {
+            headCache = head.load(memory_order_acquire);
+            if (t - headCache == N)
+                return false;
+        }
+        slots[t & (N - 1)] = item;
+        tail.store(t + 1, memory_order_release);
+        return true;
+    }
+
+    // Consumer side. Returns false if the queue is empty.
+    bool pop(T& item) {
+        size_t h = head.load(memory_order_relaxed);
+        if (h == tailCache) {
+            tailCache = tail.load(memory_order_acquire);
+            if (h == tailCache)
+                return false;
+        }
+        item = slots[h & (N - 1)];
+        head.store(h + 1, memory_order_release);
+        return true;
+    }
+
+    // Consumer side. Whether there is nothing to pop.
+    bool empty() const {
+        return head.load(memory_order_relaxed) == tail.load(memory_order_acquire);
+    }
+
+private:
+    // Consumer's index and its copy of the producer's, then the same for the
+    // producer, on separate cache lines.
+    alignas(64) atomic<size_t> head;
+    size_t tailCache;
+    alignas(64) atomic<size_t> tail;
+    size_t headCache;
+    alignas(64) T slots[N];
+};
@@ -0,0 +1,260 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "util.hpp"
+
+#pragma once
+
+using namespace std;
+
+// Where the server puts received file data. Files are preallocated when the
+// client advertised their size, so the filesystem can lay them out in one go
+// instead of growing them a packet at a time.
+class Storage {
+public:
+    virtual ~Storage() {}
+
+    // Opens path for writing at offset, keeping the bytes before it and
+    // dropping the rest. size is the expected final size, 0 if unknown.
+    virtual bool open(const string& path, uint64_t offset, uint64_t size) = 0;
+
+    // Appends data at the current offset.
+    virtual bool write(const char* data, size_t size) = 0;
+
+    // Makes everything written so far durable.
+    virtual bool sync() = 0;
+
+    // Flushes, trims the file to what was written, syncs it and closes it,
+    // so it can be renamed without a crash leaving a name with no data.
+    virtual bool close() = 0;
+
+    // Closes the file as it is on disk, dropping anything still buffered.
+    // For a file someone else has taken over and may already have renamed.
+    virtual void abandon() = 0;
+
+    virtual uint64_t offset() const = 0;
+
+    // Closes the file written at path and gives it its final name. The data
+    // is on disk before the rename, like a checkpoint (see resume.hpp).
+    virtual bool finish(const string& path, const string& finalPath) {
+        return close() && rename(path.c_str(), finalPath.c_str()) == 0;
+    }
+};
+
+// Opens or creates path and cuts it to offset, then reserves room for size.
+// The size comes from the client, so it is never taken past the largest file
+// the protocol carries, and one below the offset reserves nothing.
+int openPreallocated(const string& path, int flags, uint64_t offset, uint64_t size) {
+    int fd = ::open(path.c_str(), O_CREAT | flags, 0644);
+    if (fd < 0)
+        return -1;
+    if (ftruncate(fd, offset) != 0) {
+        ::close(fd);
+        return -1;
+    }
+    // Not every filesystem supports fallocate; the file then just grows.
+    size = min(size, MAX_FILE_SIZE);
+    if (size > offset && fallocate(fd, 0, offset, size - offset) != 0 && errno != EOPNOTSUPP)
+        perror("fallocate failed");
+    return fd;
+}
+
+bool pwriteAll(int fd, const char* data, size_t size, uint64_t offset) {
+    while (size > 0) {
+        ssize_t n = pwrite(fd, data, size, offset);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        data += n;
+        size -= n;
+        offset += n;
+    }
+    return true;
+}
+
+// Collects writes in a user space buffer and hands them to the kernel in
+// large pwrites.
+class PwriteStorage : public Storage {
+public:
+    PwriteStorage(): fd(-1), fileOffset(0) {
+        buffer.reserve(BUFFER_SIZE);
+    }
+
+    ~PwriteStorage() {
+        if (fd >= 0)
+            close();
+    }
+
+    bool open(const string& path, uint64_t offset, uint64_t size) override {
+        fd = openPreallocated(path, O_WRONLY, offset, size);
+        fileOffset = offset;
+        buffer.clear();
+        return fd >= 0;
+    }
+
+    bool write(const char* data, size_t size) override {
+        buffer.insert(buffer.end(), data, data + size);
+        return buffer.size() < BUFFER_SIZE || flush();
+    }
+
+    bool sync() override {
+        return flush() && fdatasync(fd) == 0;
+    }
+
+    bool close() override {
+        bool ok = flush() && ftruncate(fd, fileOffset) == 0 && fdatasync(fd) == 0;
+        ok = ::close(fd) == 0 && ok;
+        fd = -1;
+        return ok;
+    }
+
+    void abandon() override {
+        ::close(fd);
+        fd = -1;
+        buffer.clear();
+    }
+
+    uint64_t offset() const override {
+        return fileOffset + buffer.size();
+    }
+
+private:
+    static const size_t BUFFER_SIZE = 256 * 1024;
+
+    int fd;
+    uint64_t fileOffset; // where the buffer goes in the file
+    vector<char> buffer;
+
+    bool flush() {
+        if (buffer.empty())
+            return true;
+        if (!pwriteAll(fd, buffer.data(), buffer.size(), fileOffset))
+            return false;
+        fileOffset += buffer.size();
+        buffer.clear();
+        return true;
+    }
+};
+
+// Writes with O_DIRECT from an aligned buffer, bypassing the page cache.
+// Only whole blocks go to disk; the unfinished last block stays in the buffer
+// and is written padded when syncing, then trimmed off on close.
+class DirectStorage : public Storage {
+public:
+    DirectStorage(): fd(-1), buffer(nullptr), buffered(0), blockOffset(0) {}
+
+    ~DirectStorage() {
+        if (fd >= 0)
+            close();
+        free(buffer);
+    }
+
+    bool open(const string& path, uint64_t offset, uint64_t size) override {
+        if (buffer == nullptr && posix_memalign((void**) &buffer, ALIGN, BUFFER_SIZE) != 0) {
+            buffer = nullptr;
+            return false;
+        }
+
+        fd = openPreallocated(path, O_RDWR | O_DIRECT, offset, size);
+        if (fd < 0 && errno == EINVAL) {
+            // The filesystem doesn't do O_DIRECT; the same code works without it.
+            std::cerr << "O_DIRECT not supported for " << path << ", using the page cache" << endl;
+            fd = openPreallocated(path, O_RDWR, offset, size);
+        }
+        if (fd < 0)
+            return false;
+
+        // Resuming mid-block: load the start of that block so it can be
+        // rewritten whole.
+        blockOffset = offset & ~(uint64_t) (ALIGN - 1);
+        buffered = offset - blockOffset;
+        if (buffered > 0 && !readBlock())
+            return false;
+        return true;
+    }
+
+    bool write(const char* data, size_t size) override {
+        while (size > 0) {
+            size_t n = min(size, BUFFER_SIZE - buffered);
+            memcpy(buffer + buffered, data, n);
+            buffered += n;
+            data += n;
+            size -= n;
+            if (buffered == BUFFER_SIZE && !flush(false))
+                return false;
+        }
+        return true;
+    }
+
+    bool sync() override {
+        return flush(true) && fdatasync(fd) == 0;
+    }
+
+    bool close() override {
+        uint64_t end = offset();
+        bool ok = flush(true) && ftruncate(fd, end) == 0 && fdatasync(fd) == 0;
+        ok = ::close(fd) == 0 && ok;
+        fd = -1;
+        return ok;
+    }
+
+    void abandon() override {
+        ::close(fd);
+        fd = -1;
+        buffered = 0;
+    }
+
+    uint64_t offset() const override {
+        return blockOffset + buffered;
+    }
+
+private:
+    static const size_t ALIGN = 4096;
+    static const size_t BUFFER_SIZE = 1 << 20;
+
+    int fd;
+    char* buffer;
+    size_t buffered;      // bytes in the buffer
+    uint64_t blockOffset; // file offset of the buffer, always aligned
+
+    bool readBlock() {
+        return pread(fd, buffer, ALIGN, blockOffset) >= (ssize_t) buffered;
+    }
+
+    // Writes the whole blocks in the buffer. With padTail the last partial
+    // block is written too, zero padded, but kept in the buffer.
+    bool flush(bool padTail) {
+        size_t whole = buffered & ~(ALIGN - 1);
+        size_t tail = buffered - whole;
+        size_t len = whole;
+        if (padTail && tail > 0) {
+            memset(buffer + buffered, 0, ALIGN - tail);
+            len += ALIGN;
+        }
+        if (len > 0 && !pwriteAll(fd, buffer, len, blockOffset))
+            return false;
+
+        if (whole > 0) {
+            memmove(buffer, buffer + whole, tail);
+            blockOffset += whole;
+            buffered = tail;
+        }
+        return true;
+    }
+};
+
+unique_ptr<Storage> makeStorage(bool direct) {
+    if (direct)
+        return unique_ptr<Storage>(new DirectStorage());
+    return unique_ptr<Storage>(new PwriteStorage());
+}
@@ -0,0 +1,63 @@
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <chrono>
+#include <random>
+#include <string>
+
+#include "io.hpp"
+#include "siphash.hpp"
+
+#pragma once
+
+using namespace std;
+
+// SYN cookies let the server answer a SYN without keeping any state for it.
+// The server's initial sequence number is a SipHash of everything the
+// final ACK has to prove: the client's address and ISN, the connection ID
+// handed out and the options asked for. The client echoes its options in
+// that ACK, and only then does the server create the connection.
+//
+// Cookies are valid for one to two slots of COOKIE_SLOT_SECONDS.
+
+const int COOKIE_SLOT_SECONDS = 64;
+
+struct SynCookies {
+    uint64_t key[2];
+
+    SynCookies() {
+        random_device rd;
+        for (auto& word: key)
+            word = ((uint64_t) rd() << 32) | rd();
+    }
+
+    uint32_t make(const sockaddr& sender, uint32_t isn, uint16_t cid, const string& options, uint64_t slot) const {
+        auto in = (const sockaddr_in*) &sender;
+        string input;
+        input.append((const char*) &in->sin_addr.s_addr, sizeof in->sin_addr.s_addr);
+        input.append((const char*) &in->sin_port, sizeof in->sin_port);
+        input.append((const char*) &isn, sizeof isn);
+        input.append((const char*) &cid, sizeof cid);
+        input.append((const char*) &slot, sizeof slot);
+        input.append(options);
+        uint64_t hash = siphash24(key, input.data(), input.size());
+        // Leave room for the ISN + 1 the client acknowledges.
+        return (uint32_t) (hash ^ (hash >> 32)) & 0x7fffffff;
+    }
+
+    bool check(const sockaddr& sender, uint32_t isn, uint16_t cid, const string& options, uint32_t cookie,
+               uint64_t slot) const {
+        return cookie == make(sender, isn, cid, options, slot) ||
+               cookie == make(sender, isn, cid, options, slot - 1);
+    }
+
+    // Where to start looking for a free connection ID for this client, so a
+    // retransmitted SYN is offered the same one.
+    uint16_t cidHint(const sockaddr& sender, uint32_t isn) const {
+        return (uint16_t) make(sender, isn, 0, string(), 0);
+    }
+
+    static uint64_t slotAt(timestamp_t now) {
+        return chrono::duration_cast<chrono::seconds>(now.time_since_epoch()).count() / COOKIE_SLOT_SECONDS;
+    }
+};
@@ -0,0 +1,26 @@
+#include <iostream>
+
+#pragma once
+
+using namespace std;
+
+// What the test programs under make check share: CHECK records a failure
+// and carries on, and finish reports them as the exit code.
+
+int failures = 0;
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            cerr << "FAIL " << __FILE__ << ":" << __LINE__ << ": " << #cond << endl; \
+            failures++; \
+        } \
+    } while (0)
+
+int finish(const string& name) {
+    if (failures > 0) {
+        cerr << failures << " checks failed" << endl;
+        return 1;
+    }
+    cout << "All " << name << " tests passed" << endl;
+    return 0;
+}
@@ -0,0 +1,460 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "../compress.hpp"
+#include "../dedup.hpp"
+#include "../fec.hpp"
+#include "../lz.hpp"
+#include "../sender.hpp"
+#include "../sha256.hpp"
+#include "../siphash.hpp"
+#include "../syncookie.hpp"
+#include "check.hpp"
+
+using namespace std;
+
+// Checks the codecs on their own, without a connection around them: they
+// must give back exactly what went in and reject input they didn't produce.
+// Run with make check.
+
+string randomBytes(size_t size, uint32_t seed) {
+    mt19937 rng(seed);
+    string data(size, 0);
+    for (auto& c: data)
+        c = (char) rng();
+    return data;
+}
+
+bool lzRoundTrip(const string& data) {
+    string packed;
+    lzCompress(data.data(), data.size(), packed);
+    string out(data.size(), '\0');
+    return lzDecompress(packed.data(), packed.size(), &out[0], out.size()) && out == data;
+}
+
+bool lzAccepts(const string& block, size_t rawSize) {
+    string out(rawSize, '\0');
+    return lzDecompress(block.data(), block.size(), &out[0], rawSize);
+}
+
+// Empty, incompressible and repetitive blocks, up to and around the block
+// size, come back as they were.
+void testLzRoundTrip() {
+    CHECK(lzRoundTrip(""));
+    CHECK(lzRoundTrip("abc"));
+    CHECK(lzRoundTrip(randomBytes(COMPRESS_BLOCK_SIZE, 1)));
+    CHECK(lzRoundTrip(string(COMPRESS_BLOCK_SIZE, 'a')));
+    CHECK(lzRoundTrip(string(COMPRESS_BLOCK_SIZE - 1, 'a')));
+
+    string text;
+    while (text.size() < COMPRESS_BLOCK_SIZE)
+        text += "the quick brown fox jumps over the lazy dog " + to_string(text.size() % 97) + "\n";
+    text.resize(COMPRESS_BLOCK_SIZE);
+    CHECK(lzRoundTrip(text));
+
+    // A match as far back as an offset can reach.
+    string far = randomBytes(LZ_MAX_OFFSET + 64, 2);
+    memcpy(&far[LZ_MAX_OFFSET], far.data(), 64);
+    CHECK(lzRoundTrip(far));
+
+    string packed;
+    lzCompress(string(COMPRESS_BLOCK_SIZE, 'a').data(), COMPRESS_BLOCK_SIZE, packed);
+    CHECK(packed.size() < 1024);
+}
+
+// Back-references before the start of the output, lengths past the end and
+// cut-off blocks are rejected instead of read or written out of bounds.
+void testLzRejectsCorruptBlocks() {
+    // One literal, then a match two bytes back.
+    CHECK(!lzAccepts(string("\x10" "a" "\x02\x00", 4) + string("\x00", 1), 5));
+    // Offset 0.
+    CHECK(!lzAccepts(string("\x10" "a" "\x00\x00", 4) + string("\x00", 1), 5));
+    // A valid match that runs past the raw size.
+    CHECK(lzAccepts(string("\x10" "a" "\x01\x00", 4) + string("\x00", 1), 5));
+    CHECK(!lzAccepts(string("\x10" "a" "\x01\x00", 4) + string("\x00", 1), 4));
+    // Literals past the end of the block.
+    CHECK(!lzAccepts(string("\x50" "ab", 3), 5));
+    // A length extension that never ends.
+    CHECK(!lzAccepts(string("\xf0\xff\xff", 3), 1000));
+
+    string data(COMPRESS_BLOCK_SIZE, 'a');
+    string packed;
+    lzCompress(data.data(), data.size(), packed);
+    for (size_t cut = 1; cut < packed.size(); cut++)
+        CHECK(!lzAccepts(packed.substr(0, packed.size() - cut), data.size()));
+    CHECK(!lzAccepts(packed, data.size() + 1));
+}
+
+// A file of several blocks, the last one short, goes through compressFile
+// and comes back out of BlockDecoder fed a packet at a time. The random and
+// the short block don't shrink, so they are stored as is.
+void testBlockStream() {
+    string data = randomBytes(COMPRESS_BLOCK_SIZE, 3) + string(COMPRESS_BLOCK_SIZE, 'x') + "tail";
+    FILE* src = tmpfile();
+    CHECK(src != nullptr && fwrite(data.data(), 1, data.size(), src) == data.size());
+    rewind(src);
+
+    compress_stats_t stats;
+    FILE* stream = compressFile(src, stats);
+    CHECK(stream != nullptr);
+    CHECK(stats.blocks == 3 && stats.storedBlocks == 2 && stats.rawBytes == data.size());
+
+    BlockDecoder decoder;
+    string out;
+    char packet[MAX_PAYLOAD_SIZE];
+    size_t n;
+    bool ok = true;
+    while ((n = fread(packet, 1, sizeof packet, stream)) > 0)
+        ok = ok && decoder.feed(packet, n, out);
+    CHECK(ok && decoder.pending.empty() && out == data);
+    fclose(stream);
+    fclose(src);
+}
+
+// Encodes a group of k segments, the last lastSize bytes long, with m parity
+// rows the way the sender does, then loses the segments in missing and
+// rebuilds them from the parity rows in rows.
+bool fecRecovers(int k, int m, size_t lastSize, const vector<int>& missing, const vector<int>& rows) {
+    vector<string> group;
+    for (int i = 0; i < k; i++)
+        group.push_back(randomBytes(i == k - 1 ? lastSize : FEC_SEGMENT_SIZE, 100 * k + i));
+    size_t paritySize = k == 1 ? group[0].size() : FEC_SEGMENT_SIZE;
+
+    map<int, string> parity;
+    for (int row: rows)
+        parity[row] = fecEncode(group, m, row, paritySize);
+
+    vector<string> received = group;
+    for (int i: missing)
+        received[i].clear();
+    if (!fecDecode(received, missing, m, parity))
+        return false;
+    for (int i: missing)
+        received[i].resize(group[i].size());
+    return received == group;
+}
+
+// M = 1 is plain XOR parity: any one segment of the group can be lost,
+// including the short last one.
+void testFecXor() {
+    CHECK(fecRecovers(8, 1, FEC_SEGMENT_SIZE, { 3 }, { 0 }));
+    CHECK(fecRecovers(8, 1, 100, { 7 }, { 0 }));
+    CHECK(fecRecovers(8, 1, 100, { 0 }, { 0 }));
+    CHECK(fecRecovers(1, 1, 37, { 0 }, { 0 }));
+    CHECK(!fecRecovers(8, 1, 100, { 1, 2 }, { 0 }));
+}
+
+// Cauchy Reed-Solomon rows: any M segments can be lost, rebuilt from any M
+// of the rows, including in a short final group.
+void testFecReedSolomon() {
+    CHECK(fecRecovers(10, 4, 200, { 1, 4, 6, 9 }, { 0, 1, 2, 3 }));
+    CHECK(fecRecovers(10, 4, 200, { 2, 9 }, { 1, 3 }));
+    CHECK(fecRecovers(FEC_MAX_K, FEC_MAX_M, 1, { 0, 5, 10, 15, 20, 25, 30, 35, 40, 45, 50, 55, 60, 61, 62, 63 },
+                      { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 }));
+    // A last group shorter than K, as at the end of the stream.
+    CHECK(fecRecovers(3, 2, 10, { 0, 2 }, { 0, 1 }));
+    CHECK(fecRecovers(2, 2, 10, { 0, 1 }, { 0, 1 }));
+    // More losses than rows can't be undone.
+    CHECK(!fecRecovers(10, 4, 200, { 1, 2, 3 }, { 0, 1 }));
+
+    // Every pair of losses with every pair of rows.
+    bool all = true;
+    for (int a = 0; a < 6; a++)
+        for (int b = a + 1; b < 6; b++)
+            for (int r = 0; r < 3; r++)
+                for (int q = r + 1; q < 3; q++)
+                    all = all && fecRecovers(6, 3, 300, { a, b }, { r, q });
+    CHECK(all);
+}
+
+string hex(const string& bytes) {
+    static const char* digits = "0123456789abcdef";
+    string out;
+    for (unsigned char c: bytes) {
+        out += digits[c >> 4];
+        out += digits[c & 15];
+    }
+    return out;
+}
+
+// Hashes data fed in pieces of every size from 1 to 70 bytes in turn, so
+// block boundaries fall everywhere.
+string sha256Pieces(const string& data) {
+    Sha256 sha;
+    size_t piece = 1;
+    for (size_t pos = 0; pos < data.size(); pos += piece, piece = piece % 70 + 1)
+        sha.update(data.data() + pos, min(piece, data.size() - pos));
+    return hex(sha.digest());
+}
+
+// The FIPS 180-2 examples, plus the empty message.
+void testSha256() {
+    CHECK(sha256Pieces("") == "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+    CHECK(sha256Pieces("abc") == "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+    CHECK(sha256Pieces("abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq") ==
+          "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1");
+    CHECK(sha256Pieces(string(1000000, 'a')) == "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0");
+
+    Sha256 whole;
+    whole.update("abc", 3);
+    CHECK(hex(whole.digest()) == "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+}
+
+FILE* tmpfileWith(const string& data) {
+    FILE* fd = tmpfile();
+    if (fd != nullptr && fwrite(data.data(), 1, data.size(), fd) == data.size()) {
+        rewind(fd);
+        return fd;
+    }
+    return nullptr;
+}
+
+// Content-defined cut points: chunks stay within the limits, cover the file,
+// and mostly survive bytes inserted at the front.
+void testChunkFile() {
+    string data = randomBytes(300000, 4);
+    vector<chunk_t> chunks, shifted;
+    FILE* fd = tmpfileWith(data);
+    FILE* moved = tmpfileWith("inserted" + data);
+    CHECK(chunkFile(fd, chunks) && chunkFile(moved, shifted));
+    fclose(fd);
+    fclose(moved);
+
+    uint32_t offset = 0;
+    for (size_t i = 0; i < chunks.size(); i++) {
+        CHECK(chunks[i].offset == offset && chunks[i].size <= DEDUP_MAX_CHUNK);
+        CHECK(chunks[i].size >= DEDUP_MIN_CHUNK || i == chunks.size() - 1);
+        CHECK(chunks[i].digest == chunkDigest(data.data() + offset, chunks[i].size));
+        offset += chunks[i].size;
+    }
+    CHECK(offset == data.size());
+
+    unordered_set<string> digests;
+    for (auto& chunk: chunks)
+        digests.insert(chunk.digest);
+    size_t same = 0;
+    for (auto& chunk: shifted)
+        same += digests.count(chunk.digest);
+    CHECK(same + 2 >= chunks.size());
+}
+
+// Ranges survive encoding, are merged when they don't fit in an answer, and
+// ranges past the chunk count are refused.
+void testChunkRanges() {
+    chunk_ranges_t ranges { { 0, 3 }, { 10, 1 }, { 200, 5000 } };
+    chunk_ranges_t sent = ranges, parsed;
+    string encoded = formatRanges(sent);
+    CHECK(sent == ranges);
+    CHECK(parseRanges(encoded, 5200, parsed) && parsed == ranges);
+    parsed.clear();
+    CHECK(!parseRanges(encoded, 5199, parsed));
+
+    chunk_ranges_t many;
+    for (uint32_t i = 0; i < 1000; i++)
+        many.push_back(make_pair(i * 3, 1));
+    chunk_ranges_t merged = many;
+    encoded = formatRanges(merged);
+    CHECK(encoded.size() <= DEDUP_MAX_ANSWER && merged.size() < many.size());
+    parsed.clear();
+    CHECK(parseRanges(encoded, 3000, parsed) && parsed == merged);
+    // Every chunk asked for is still covered.
+    size_t next = 0;
+    for (auto& range: many) {
+        while (next < merged.size() && merged[next].first + merged[next].second <= range.first)
+            next++;
+        CHECK(next < merged.size() && merged[next].first <= range.first);
+    }
+}
+
+// Sends data through DedupSource to a DedupAssembler storing chunks in dir,
+// a packet at a time, with the answer in between like the real exchange.
+// Returns what the assembler wrote.
+string dedupTransfer(const string& dir, const string& data, dedup_stats_t& stats, bool& ok) {
+    vector<chunk_t> chunks;
+    FILE* fd = tmpfileWith(data);
+    ok = fd != nullptr && chunkFile(fd, chunks);
+    FileSource raw(fd, data.size());
+    DedupSource source(raw, chunks);
+    DedupAssembler assembler;
+    assembler.dir = dir;
+
+    string out;
+    auto write = [&out](const char* data, size_t size) {
+        out.append(data, size);
+        return true;
+    };
+    char packet[MAX_PAYLOAD_SIZE];
+    uint32_t offset = 0;
+    while (ok && offset < source.size()) {
+        size_t n = source.read(offset, packet, sizeof packet);
+        ok = n > 0 && assembler.feed(packet, n, write);
+        offset += n;
+        if (offset == source.manifestSize()) {
+            chunk_ranges_t ranges;
+            ok = ok && assembler.awaitingChunks(offset) && parseRanges(assembler.answer, chunks.size(), ranges);
+            source.select(ranges);
+        }
+    }
+    ok = ok && assembler.complete();
+    stats = assembler.stats;
+    if (fd != nullptr)
+        fclose(fd);
+    return out;
+}
+
+// The first transfer sends every chunk, a file repeating one sends it once,
+// and an edited copy only sends the chunks the edit touched.
+void testDedupRoundTrip() {
+    char tmpl[] = "/tmp/codec_test_dedup_XXXXXX";
+    string dir = mkdtemp(tmpl);
+    string data = randomBytes(400000, 5);
+    dedup_stats_t stats;
+    bool ok;
+
+    CHECK(dedupTransfer(dir, data, stats, ok) == data && ok);
+    CHECK(stats.sentChunks == stats.chunks && stats.chunks > 10);
+
+    CHECK(dedupTransfer(dir, data, stats, ok) == data && ok);
+    CHECK(stats.sentChunks == 0 && stats.sentBytes == 0);
+
+    string edited = data;
+    memcpy(&edited[200000], "edited", 6);
+    edited += randomBytes(30000, 6);
+    CHECK(dedupTransfer(dir, edited, stats, ok) == edited && ok);
+    CHECK(stats.sentChunks > 0 && stats.sentChunks <= 6);
+
+    string repeated = randomBytes(100000, 7);
+    repeated += repeated;
+    CHECK(dedupTransfer(dir, repeated, stats, ok) == repeated && ok);
+    // The second copy cuts the same way again after its first chunk.
+    CHECK(stats.sentBytes > 0 && stats.sentBytes <= stats.rawBytes / 2 + DEDUP_MAX_CHUNK);
+
+    CHECK(system(("rm -rf " + dir).c_str()) == 0);
+}
+
+// A chunk the store can't take fails the transfer, and a chunk that went bad
+// in the store fails one transfer and is asked for again by the next.
+void testDedupStoreFailures() {
+    char tmpl[] = "/tmp/codec_test_dedup_XXXXXX";
+    string dir = mkdtemp(tmpl);
+    string data = randomBytes(200000, 9);
+    dedup_stats_t stats;
+    bool ok;
+
+    string blocked = dir + "/" + CHUNK_DIR;
+    FILE* fd = fopen(blocked.c_str(), "w");
+    CHECK(fd != nullptr && fclose(fd) == 0);
+    dedupTransfer(dir, data, stats, ok);
+    CHECK(!ok);
+    CHECK(remove(blocked.c_str()) == 0);
+
+    CHECK(dedupTransfer(dir, data, stats, ok) == data && ok);
+    vector<chunk_t> chunks;
+    fd = tmpfileWith(data);
+    CHECK(fd != nullptr && chunkFile(fd, chunks) && chunks.size() > 1);
+    fclose(fd);
+    string bad = chunkPath(dir, chunks[1].digest);
+    fd = fopen(bad.c_str(), "r+b");
+    CHECK(fd != nullptr && fputc('x', fd) != EOF && fclose(fd) == 0);
+
+    dedupTransfer(dir, data, stats, ok);
+    CHECK(!ok);
+    CHECK(dedupTransfer(dir, data, stats, ok) == data && ok);
+    CHECK(stats.sentChunks == 1 && stats.sentBytes == chunks[1].size);
+
+    CHECK(system(("rm -rf " + dir).c_str()) == 0);
+}
+
+// SipHash-2-4 with the key 00 01 .. 0f on the messages 00 01 .. (n - 1),
+// from the reference implementation's vectors; n = 15 is the example in the
+// paper's appendix.
+void testSipHash() {
+    const uint64_t key[2] = { 0x0706050403020100ull, 0x0f0e0d0c0b0a0908ull };
+    const pair<size_t, uint64_t> vectors[] = {
+        { 0, 0x726fdb47dd0e0e31ull }, { 1, 0x74f839c593dc67fdull }, { 2, 0x0d6c8009d9a94f5aull },
+        { 3, 0x85676696d7fb7e2dull }, { 4, 0xcf2794e0277187b7ull }, { 5, 0x18765564cd99a68dull },
+        { 6, 0xcbc9466e58fee3ceull }, { 7, 0xab0200f58b01d137ull }, { 8, 0x93f5f5799a932462ull },
+        { 9, 0x9e0082df0ba9e4b0ull }, { 15, 0xa129ca6149be45e5ull }, { 63, 0x958a324ceb064572ull },
+    };
+    unsigned char message[64];
+    for (int i = 0; i < 64; i++)
+        message[i] = i;
+    for (auto& vector: vectors)
+        CHECK(siphash24(key, message, vector.first) == vector.second);
+}
+
+// A cookie only checks out for exactly what it was made for, in its own slot
+// or the one after.
+void testSynCookies() {
+    SynCookies cookies;
+    sockaddr_in in;
+    memset(&in, 0, sizeof in);
+    in.sin_family = AF_INET;
+    in.sin_addr.s_addr = htonl(0x7f000001);
+    in.sin_port = htons(5000);
+    sockaddr& addr = (sockaddr&) in;
+
+    uint32_t cookie = cookies.make(addr, 12345, 7, "opts", 100);
+    CHECK(cookie < 0x80000000u);
+    CHECK(cookies.check(addr, 12345, 7, "opts", cookie, 100));
+    CHECK(cookies.check(addr, 12345, 7, "opts", cookie, 101));
+    CHECK(!cookies.check(addr, 12345, 7, "opts", cookie, 102));
+    CHECK(!cookies.check(addr, 12346, 7, "opts", cookie, 100));
+    CHECK(!cookies.check(addr, 12345, 8, "opts", cookie, 100));
+    CHECK(!cookies.check(addr, 12345, 7, "optz", cookie, 100));
+    in.sin_port = htons(5001);
+    CHECK(!cookies.check(addr, 12345, 7, "opts", cookie, 100));
+
+    // Another server's key gives other cookies.
+    SynCookies other;
+    CHECK(!other.check(addr, 12345, 7, "opts", cookies.make(addr, 12345, 7, "opts", 100), 100));
+}
+
+// The longest option block there is still fits the client's ACK queue slots,
+// and comes back the same.
+void testOptionBlockFits() {
+    options_t opts;
+    opts.compress = true;
+    opts.resumeToken = 0x0123456789abcdefull;
+    opts.resumed = true;
+    opts.resumeOffset = 4096;
+    opts.fileSize = 100 * 1024 * 1024;
+    opts.cookie = true;
+    opts.fecK = 8;
+    opts.fecM = 2;
+    opts.dedup = true;
+    opts.answered = true;
+    opts.missingChunks = randomBytes(DEDUP_MAX_ANSWER, 8);
+
+    char buf[MAX_PAYLOAD_SIZE];
+    size_t size = formatOptions(buf, opts);
+    CHECK(size <= MAX_OPTIONS_SIZE);
+
+    options_t parsed;
+    CHECK(parseOptions(buf, size, parsed) == size);
+    CHECK(parsed.resumeToken == opts.resumeToken && parsed.resumeOffset == opts.resumeOffset);
+    CHECK(parsed.fileSize == opts.fileSize && parsed.fecK == 8 && parsed.fecM == 2);
+    CHECK(parsed.missingChunks == opts.missingChunks);
+}
+
+int main() {
+    testLzRoundTrip();
+    testLzRejectsCorruptBlocks();
+    testBlockStream();
+    testFecXor();
+    testFecReedSolomon();
+    testSha256();
+    testChunkFile();
+    testChunkRanges();
+    testDedupRoundTrip();
+    testDedupStoreFailures();
+    testSipHash();
+    testSynCookies();
+    testOptionBlockFits();
+
+    return finish("codec");
+}
@@ -0,0 +1,353 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/stat.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "../io.hpp"
+#include "../protocol.hpp"
+#include "../receiver.hpp"
+#include "check.hpp"
+
+using namespace std;
+
+// Drives the server's Receiver with hand-made packets in virtual time and
+// checks what it answers and writes. Run with make check.
+
+class TestClock : public Clock {
+public:
+    timestamp_t t;
+
+    timestamp_t now() override { return t; }
+    void advance(double ms) { t = afterMillis(t, ms); }
+};
+
+struct sent_t {
+    header_t header;
+    string payload;
+    uint16_t port;
+};
+
+class Capture : public PacketIO {
+public:
+    vector<sent_t> sent;
+
+    void send(const char* packet, size_t size, const sockaddr& to) override {
+        char copy[MAX_PACKET_SIZE];
+        memcpy(copy, packet, size);
+        sent.push_back(sent_t { getHeader(copy, size), getPayload(copy, size), ntohs(((const sockaddr_in&) to).sin_port) });
+    }
+};
+
+sockaddr clientAddr(uint16_t port) {
+    sockaddr_in in;
+    memset(&in, 0, sizeof in);
+    in.sin_family = AF_INET;
+    in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    in.sin_port = htons(port);
+    return (sockaddr&) in;
+}
+
+string readFile(const string& path) {
+    ifstream in(path, ios::binary);
+    stringstream out;
+    out << in.rdbuf();
+    return out.str();
+}
+
+// A Receiver saving to a fresh directory, and what it sends.
+struct Server {
+    TestClock clock;
+    Capture io;
+    string dir;
+    Receiver receiver;
+
+    explicit Server(const string& name): dir(makeDir(name)), receiver(clock, io, dir) {
+        receiver.log = false;
+    }
+
+    ~Server() {
+        receiver.shutdown();
+        if (system(("rm -rf " + dir).c_str()) != 0)
+            cerr << "Failed to remove " << dir << endl;
+    }
+
+    static string makeDir(const string& name) {
+        char tmpl[256];
+        snprintf(tmpl, sizeof tmpl, "/tmp/receiver_test_%s_XXXXXX", name.c_str());
+        return mkdtemp(tmpl);
+    }
+
+    void packet(header_t header, const string& payload, uint16_t port) {
+        char buffer[MAX_PACKET_SIZE];
+        size_t size = formatSendPacket(buffer, header, payload.data(), payload.size());
+        receiver.onPacket(buffer, size, clientAddr(port));
+    }
+
+    // Sends a SYN with the given options and returns the SYN-ACK.
+    sent_t syn(uint32_t isn, const options_t& opts, uint16_t port) {
+        header_t header { isn, 0, 0, false, true, false };
+        header.o = true;
+        size_t before = io.sent.size();
+        packet(header, optionBlock(opts), port);
+        return io.sent.size() > before ? io.sent.back() : sent_t {};
+    }
+
+    // Completes a cookie handshake by echoing the options.
+    void echo(const sent_t& synAck, const options_t& opts, uint16_t port) {
+        header_t header { synAck.header.ack, synAck.header.seq + 1, synAck.header.cid, true, false, false };
+        header.o = true;
+        packet(header, optionBlock(opts), port);
+    }
+
+    static string optionBlock(const options_t& opts) {
+        char optBuffer[MAX_PAYLOAD_SIZE];
+        return string(optBuffer, formatOptions(optBuffer, opts));
+    }
+
+    // Sends data in full packets from seq on, then a FIN.
+    void transfer(uint32_t seq, uint16_t cid, const string& data, uint16_t port) {
+        for (size_t pos = 0; pos < data.size(); pos += MAX_PAYLOAD_SIZE) {
+            string part = data.substr(pos, MAX_PAYLOAD_SIZE);
+            packet(header_t { seq, 0, cid, true, false, false }, part, port);
+            seq += part.size();
+        }
+        packet(header_t { seq, 0, cid, false, false, true }, "", port);
+    }
+};
+
+string pattern(size_t size) {
+    string data(size, 0);
+    for (size_t i = 0; i < size; i++)
+        data[i] = (char) (i * 7 + i / 256);
+    return data;
+}
+
+bool exists(const string& path) {
+    return access(path.c_str(), F_OK) == 0;
+}
+
+// A compressed stream that turns out to be corrupt fails the connection:
+// the bad data isn't acknowledged and the file says ERROR.
+void testCorruptCompressedStream() {
+    Server server("corrupt");
+    options_t opts;
+    opts.compress = true;
+    opts.fileSize = 100;
+    auto synAck = server.syn(12345, opts, 5000);
+    uint16_t cid = synAck.header.cid;
+    CHECK(synAck.header.s && cid != 0);
+
+    string block(BLOCK_FRAME_SIZE + 10, 'x');
+    block[0] = 7; // no such block kind
+    int2buf(&block[0], 10, 1, 5);
+    int2buf(&block[0], 10, 5, 9);
+    size_t before = server.io.sent.size();
+    server.packet(header_t { 12346, synAck.header.seq + 1, cid, true, false, false }, block, 5000);
+    CHECK(server.io.sent.size() == before);
+    CHECK(readFile(server.receiver.finalPath(cid)) == "ERROR");
+
+    // Nor is anything after it.
+    server.packet(header_t { (uint32_t) (12346 + block.size()), 0, cid, false, false, false }, "more", 5000);
+    CHECK(server.io.sent.size() == before);
+}
+
+// A client that resumes a transfer while its old connection is still alive,
+// here from a new port, takes the transfer over. The old connection expiring
+// afterwards must not touch the finished file or leave a checkpoint behind.
+void testResumeWhileOldConnectionAlive() {
+    Server server("resume");
+    string data = pattern(3000);
+    options_t opts;
+    opts.resumeToken = 0x1234567890abcdefULL;
+    opts.fileSize = data.size();
+
+    auto first = server.syn(1000, opts, 5000);
+    uint16_t oldCid = first.header.cid;
+    CHECK(first.header.s && oldCid != 0);
+    server.packet(header_t { 1001, first.header.seq + 1, oldCid, true, false, false }, data.substr(0, MAX_PAYLOAD_SIZE), 5000);
+    server.clock.advance(100);
+
+    auto second = server.syn(2000, opts, 5001);
+    uint16_t newCid = second.header.cid;
+    CHECK(second.header.s && newCid != 0 && newCid != oldCid);
+    server.transfer(2001, newCid, data, 5001);
+    CHECK(readFile(server.receiver.finalPath(newCid)) == data);
+
+    // Nothing more is heard from the old connection until it has expired.
+    server.clock.advance(server.receiver.tuning.timeoutTimer + 2000);
+    server.receiver.tick();
+    server.packet(header_t { 1001 + MAX_PAYLOAD_SIZE, 0, oldCid, true, false, false }, data.substr(MAX_PAYLOAD_SIZE, MAX_PAYLOAD_SIZE), 5000);
+    server.receiver.shutdown();
+
+    CHECK(readFile(server.receiver.finalPath(newCid)) == data);
+    CHECK(readFile(server.receiver.finalPath(oldCid)) == "ERROR");
+    CHECK(!exists(checkpointPath(server.dir, opts.resumeToken)));
+    CHECK(!exists(partialPath(server.dir, opts.resumeToken)));
+}
+
+// The file size a client advertises is only trusted up to the largest file
+// the protocol carries when reserving disk space.
+void testPreallocationIsCapped() {
+    Server server("prealloc");
+    options_t opts;
+    opts.fileSize = 0xffffffff;
+    auto synAck = server.syn(3000, opts, 5000);
+    uint16_t cid = synAck.header.cid;
+    server.packet(header_t { 3001, synAck.header.seq + 1, cid, true, false, false }, "hello", 5000);
+
+    struct stat st;
+    CHECK(stat((server.dir + "/." + to_string(cid) + ".file.tmp").c_str(), &st) == 0);
+    CHECK((uint64_t) st.st_blocks * 512 <= MAX_FILE_SIZE);
+}
+
+// A client that goes quiet part way through gets an ERROR file once the
+// timeout has passed, without sending anything more.
+void testIdleConnectionExpires() {
+    Server server("idle");
+    auto synAck = server.syn(4000, options_t(), 5000);
+    uint16_t cid = synAck.header.cid;
+    server.packet(header_t { 4001, synAck.header.seq + 1, cid, true, false, false }, "partial", 5000);
+
+    server.clock.advance(server.receiver.tuning.timeoutTimer + 2000);
+    server.receiver.tick();
+    CHECK(readFile(server.receiver.finalPath(cid)) == "partialERROR");
+    CHECK(server.receiver.connectionCount() == 1);
+
+    // It is forgotten after another timeout.
+    server.clock.advance(server.receiver.tuning.timeoutTimer + 2000);
+    server.receiver.tick();
+    CHECK(server.receiver.connectionCount() == 0);
+}
+
+// Under SYN cookies nothing is kept for an offered connection ID, so two
+// clients can be offered the same one. Each gets its own connection, and
+// packets with that ID from anyone else are dropped.
+void testCookieCidCollision() {
+    Server server("cookies");
+    server.receiver.synCookies = true;
+    options_t opts;
+    string first = pattern(2000), second = pattern(1500) + "!";
+
+    auto synAckA = server.syn(1000, opts, 5000);
+    uint16_t cid = synAckA.header.cid;
+    CHECK(synAckA.header.s && cid != 0);
+
+    // Find a SYN from another client that is offered the same ID.
+    sent_t synAckB {};
+    for (uint32_t isn = 1; isn < (1 << 22) && synAckB.header.cid != cid; isn++) {
+        server.io.sent.clear();
+        synAckB = server.syn(isn, opts, 5001);
+    }
+    CHECK(synAckB.header.cid == cid);
+
+    server.echo(synAckA, opts, 5000);
+    server.echo(synAckB, opts, 5001);
+    CHECK(server.receiver.connectionCount() == 2);
+
+    server.io.sent.clear();
+    server.transfer(synAckB.header.ack, cid, second, 5001);
+    server.transfer(synAckA.header.ack, cid, first, 5000);
+    for (auto& sent: server.io.sent)
+        CHECK(sent.header.cid == cid);
+
+    uint64_t drops = server.receiver.drops;
+    server.packet(header_t { 1, 0, cid, true, false, false }, "intruder", 5002);
+    CHECK(server.receiver.drops == drops + 1);
+
+    CHECK(readFile(server.receiver.finalPath(cid)) == first);
+    bool found = false;
+    for (uint16_t other = 1; other < 10; other++)
+        found = found || (other != cid && readFile(server.receiver.finalPath(other)) == second);
+    CHECK(found);
+}
+
+// Once a finished transfer is forgotten, a cookie SYN that would be offered
+// its ID again, as a repeat of the same client address and ISN is, gets
+// another one, so the finished file stays as it was.
+void testSweptCidNotReused() {
+    Server server("reuse");
+    server.receiver.synCookies = true;
+    options_t opts;
+    string first = pattern(1000), second = pattern(700) + "?";
+
+    auto synAck = server.syn(1000, opts, 5000);
+    uint16_t cid = synAck.header.cid;
+    server.echo(synAck, opts, 5000);
+    server.transfer(synAck.header.ack, cid, first, 5000);
+    CHECK(readFile(server.receiver.finalPath(cid)) == first);
+
+    for (int i = 0; i < 3; i++) {
+        server.clock.advance(server.receiver.tuning.timeoutTimer + 2000);
+        server.receiver.tick();
+    }
+    CHECK(server.receiver.connectionCount() == 0);
+
+    auto again = server.syn(1000, opts, 5000);
+    CHECK(again.header.s && again.header.cid != cid);
+    server.echo(again, opts, 5000);
+    server.transfer(again.header.ack, again.header.cid, second, 5000);
+    CHECK(readFile(server.receiver.finalPath(cid)) == first);
+    CHECK(readFile(server.receiver.finalPath(again.header.cid)) == second);
+
+    // Likewise when the ID was offered before the transfer holding it was
+    // over and forgotten.
+    auto holder = server.syn(3000, opts, 5002);
+    uint16_t taken = holder.header.cid;
+    sent_t early {};
+    for (uint32_t isn = 1; isn < (1 << 22) && early.header.cid != taken; isn++) {
+        server.io.sent.clear();
+        early = server.syn(isn, opts, 5001);
+    }
+    CHECK(early.header.cid == taken);
+    server.echo(holder, opts, 5002);
+    server.transfer(holder.header.ack, taken, first, 5002);
+    for (int i = 0; i < 3; i++) {
+        server.clock.advance(server.receiver.tuning.timeoutTimer + 2000);
+        server.receiver.tick();
+    }
+    CHECK(server.receiver.connectionCount() == 0);
+
+    // The cookie is still good for one more slot.
+    server.echo(early, opts, 5001);
+    CHECK(server.receiver.connectionCount() == 1);
+    server.transfer(early.header.ack, taken, second, 5001);
+    CHECK(readFile(server.receiver.finalPath(taken)) == first);
+}
+
+// Stopping the server doesn't pass a partial plain transfer off as a whole
+// file, but a resumable one keeps its progress for the next attempt.
+void testShutdownMarksPartialFiles() {
+    Server server("shutdown");
+    auto plain = server.syn(5000, options_t(), 5000);
+    server.packet(header_t { 5001, plain.header.seq + 1, plain.header.cid, true, false, false }, "partial", 5000);
+
+    options_t opts;
+    opts.resumeToken = 0xfeedull;
+    auto resumable = server.syn(6000, opts, 5001);
+    server.packet(header_t { 6001, resumable.header.seq + 1, resumable.header.cid, true, false, false }, "kept", 5001);
+
+    server.receiver.shutdown();
+    CHECK(readFile(server.receiver.finalPath(plain.header.cid)) == "partialERROR");
+    CHECK(!exists(server.receiver.finalPath(resumable.header.cid)));
+    CHECK(readFile(partialPath(server.dir, opts.resumeToken)) == "kept");
+    CHECK(exists(checkpointPath(server.dir, opts.resumeToken)));
+}
+
+int main() {
+    testCorruptCompressedStream();
+    testResumeWhileOldConnectionAlive();
+    testPreallocationIsCapped();
+    testIdleConnectionExpires();
+    testCookieCidCollision();
+    testSweptCidNotReused();
+    testShutdownMarksPartialFiles();
+
+    return finish("receiver");
+}
@@ -0,0 +1,205 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#include "util.hpp"
+
+#pragma once
+
+using namespace std;
+
+// The transport parameters, picked at run time from a named profile and
+// optionally a config file. The defaults are the compile-time values in
+// util.hpp, which the reference implementation uses.
+
+// The sequence space wraps at MAX_SEQ_NUM, and both sides tell old bytes
+// from new ones by which half of it they fall in. No window can be larger.
+const uint32_t MAX_WINDOW = MAX_SEQ_NUM / 2;
+// Auto tuning never sets a retransmission timer below this
+const double AUTO_MIN_RTO = 50;
+
+struct tuning_t {
+    string profile = "default";
+    uint32_t minCwnd = MIN_CWND;
+    uint32_t maxCwnd = MAX_CWND;
+    // How far past the next expected byte the server queues data, and how
+    // far the client assumes it may send
+    uint32_t rwnd = RWND;
+    uint32_t initSsThresh = INIT_SS_THRESH;
+    double retransmissionTimer = RETRANSMISSION_TIMER;
+    double timeoutTimer = TIMEOUT_TIMER;
+    // Socket buffer sizes in bytes, 0 for the kernel's default
+    int sndBuf = 0;
+    int rcvBuf = 0;
+    // Measure the path during the first round trips and size the window,
+    // retransmission timer and socket buffers to it (client only)
+    bool autoSize = false;
+};
+
+// Fills in the named profile. Returns false if there is none by that name.
+//   lan:       short round trips, so a short retransmission timer and slow
+//              start up to the full window
+//   wan:       the default timers with large socket buffers
+//   satellite: round trips of 600 ms and more, so long timers
+//   auto:      starts like wan, without a slow start threshold, and
+//              measures the path
+bool setProfile(tuning_t& tuning, const string& name) {
+    tuning_t base;
+    if (name == "lan") {
+        base.retransmissionTimer = 100;
+        base.timeoutTimer = 5000;
+        base.initSsThresh = MAX_WINDOW;
+        base.sndBuf = base.rcvBuf = 256 * 1024;
+    } else if (name == "wan") {
+        base.initSsThresh = 25600;
+        base.sndBuf = base.rcvBuf = 1024 * 1024;
+    } else if (name == "satellite") {
+        base.retransmissionTimer = 2000;
+        base.timeoutTimer = 30000;
+        base.initSsThresh = MAX_WINDOW;
+        base.sndBuf = base.rcvBuf = 4 * 1024 * 1024;
+    } else if (name == "auto") {
+        // Slow start until the rate stops growing
+        setProfile(base, "wan");
+        base.initSsThresh = MAX_WINDOW;
+        base.autoSize = true;
+    } else if (name != "default") {
+        return false;
+    }
+    base.profile = name;
+    tuning = base;
+    return true;
+}
+
+// Checks the parameters fit together and the protocol. Returns false and
+// sets error if they don't.
+bool checkTuning(const tuning_t& tuning, string& error) {
+    if (tuning.minCwnd < (uint32_t) MAX_PAYLOAD_SIZE)
+        error = "min_cwnd has to fit a full packet, " + to_string(MAX_PAYLOAD_SIZE) + " bytes";
+    else if (tuning.maxCwnd < tuning.minCwnd || tuning.rwnd < tuning.minCwnd)
+        error = "max_cwnd and rwnd can't be below min_cwnd";
+    else if (tuning.maxCwnd > MAX_WINDOW || tuning.rwnd > MAX_WINDOW)
+        error = "max_cwnd and rwnd can't exceed half the sequence space, " + to_string(MAX_WINDOW) + " bytes";
+    else if (tuning.retransmissionTimer <= 0 || tuning.timeoutTimer <= tuning.retransmissionTimer)
+        error = "timers have to be positive, with the timeout longer than the retransmission timer";
+    else if (tuning.sndBuf < 0 || tuning.rcvBuf < 0)
+        error = "socket buffer sizes can't be negative";
+    else
+        return true;
+    return false;
+}
+
+// Reads a config file of "key = value" lines; # starts a comment. A profile
+// line resets everything to that profile, so it goes first. Returns false and
+// sets error if the file can't be read or has a bad line.
+bool loadTuning(const string& path, tuning_t& tuning, string& error) {
+    ifstream in(path);
+    if (!in) {
+        error = "can't open " + path;
+        return false;
+    }
+
+    string line;
+    for (int number = 1; getline(in, line); number++) {
+        line = line.substr(0, line.find('#'));
+        size_t eq = line.find('=');
+        istringstream keyIn(line.substr(0, eq));
+        string key;
+        if (!(keyIn >> key))
+            continue;
+        string where = path + ":" + to_string(number) + ": ";
+        istringstream valueIn(eq == string::npos ? "" : line.substr(eq + 1));
+        string value, extra;
+        if (!(valueIn >> value) || valueIn >> extra) {
+            error = where + "expected " + key + " = <value>";
+            return false;
+        }
+
+        try {
+            if (key == "profile") {
+                if (!setProfile(tuning, value)) {
+                    error = where + "unknown profile " + value;
+                    return false;
+                }
+            } else if (key == "min_cwnd") {
+                tuning.minCwnd = stoul(value);
+            } else if (key == "max_cwnd") {
+                tuning.maxCwnd = stoul(value);
+            } else if (key == "rwnd") {
+                tuning.rwnd = stoul(value);
+            } else if (key == "init_ssthresh") {
+                tuning.initSsThresh = stoul(value);
+            } else if (key == "retransmission_timer") {
+                tuning.retransmissionTimer = stod(value);
+            } else if (key == "timeout_timer") {
+                tuning.timeoutTimer = stod(value);
+            } else if (key == "sndbuf") {
+                tuning.sndBuf = stoi(value);
+            } else if (key == "rcvbuf") {
+                tuning.rcvBuf = stoi(value);
+            } else if (key == "auto") {
+                if (value != "true" && value != "false")
+                    throw invalid_argument(value);
+                tuning.autoSize = value == "true";
+            } else {
+                error = where + "unknown key " + key;
+                return false;
+            }
+        } catch (exception const &e) {
+            error = where + "bad value " + value + " for " + key;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Parses --profile NAME and --config FILE at argv[i], leaving i on the
+// value. Returns false if argv[i] is neither. Exits on a bad value.
+bool parseTuningFlag(int argc, const char* argv[], int& i, tuning_t& tuning) {
+    string flag(argv[i]);
+    if (flag != "--profile" && flag != "--config")
+        return false;
+    if (i + 1 >= argc) {
+        cerr << "ERROR: " << flag << " needs a value" << endl;
+        exit(1);
+    }
+
+    string value(argv[++i]);
+    string error;
+    if (flag == "--profile" && !setProfile(tuning, value)) {
+        cerr << "ERROR: Unknown profile " << value << ", expected default, lan, wan, satellite or auto" << endl;
+        exit(1);
+    }
+    if (flag == "--config" && !loadTuning(value, tuning, error)) {
+        cerr << "ERROR: " << error << endl;
+        exit(1);
+    }
+    return true;
+}
+
+// Sets the socket's buffer sizes where they are given. The kernel caps them
+// at net.core.wmem_max and rmem_max, which is worth knowing about.
+void setSocketBuffers(int fd, int sndBuf, int rcvBuf) {
+    const int options[] = { SO_SNDBUF, SO_RCVBUF };
+    const int sizes[] = { sndBuf, rcvBuf };
+    const char* names[] = { "SO_SNDBUF", "SO_RCVBUF" };
+    for (int i = 0; i < 2; i++) {
+        if (sizes[i] <= 0)
+            continue;
+        if (setsockopt(fd, SOL_SOCKET, options[i], &sizes[i], sizeof sizes[i]) < 0) {
+            perror(names[i]);
+            continue;
+        }
+        // Linux reports twice the size asked for, to account for bookkeeping.
+        int actual = 0;
+        socklen_t length = sizeof actual;
+        if (getsockopt(fd, SOL_SOCKET, options[i], &actual, &length) == 0 && actual / 2 < sizes[i])
+            cerr << "WARNING: " << names[i] << " capped at " << actual / 2 << " of " << sizes[i]
+                 << " bytes, see net.core." << (i == 0 ? "wmem_max" : "rmem_max") << endl;
+    }
+}
@@ -0,0 +1,91 @@
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <stdio.h>
+
+#pragma once
+
+using namespace std;
+
+// Host-wide UDP error counters, which include datagrams the server's socket
+// had no room for when it runs on this machine.
+struct udp_counters_t {
+    long long inErrors = 0;
+    long long rcvbufErrors = 0;
+};
+
+udp_counters_t readUdpCounters() {
+    udp_counters_t counters;
+    ifstream snmp("/proc/net/snmp");
+    string names, values;
+    while (getline(snmp, names)) {
+        if (names.compare(0, 4, "Udp:") != 0 || !getline(snmp, values))
+            continue;
+        istringstream n(names), v(values);
+        string name, value;
+        while (n >> name && v >> value) {
+            if (name == "InErrors")
+                counters.inErrors = stoll(value);
+            else if (name == "RcvbufErrors")
+                counters.rcvbufErrors = stoll(value);
+        }
+        break;
+    }
+    return counters;
+}
+
+// Datagrams the kernel dropped for lack of room at the IPv4 UDP socket bound
+// to port, the last column of /proc/net/udp. -1 if there is no such socket.
+long long readSocketDrops(uint16_t port) {
+    ifstream udp("/proc/net/udp");
+    string line;
+    getline(udp, line);
+    while (getline(udp, line)) {
+        istringstream in(line);
+        vector<string> fields;
+        string field;
+        while (in >> field)
+            fields.push_back(field);
+        if (fields.size() < 13)
+            continue;
+        auto colon = fields[1].find(':');
+        if (colon != string::npos && stoul(fields[1].substr(colon + 1), nullptr, 16) == port)
+            return stoll(fields.back());
+    }
+    return -1;
+}
+
+// What the server itself saw: packets the receiver dropped for belonging to
+// no open connection, and overflows of its socket's receive buffer.
+struct server_stats_t {
+    long long drops = 0;
+    long long socketDrops = 0;
+};
+
+// Written to a temporary name first, so a reader never sees half of it.
+bool writeServerStats(const string& path, const server_stats_t& stats) {
+    string tmp = path + ".tmp";
+    {
+        ofstream out(tmp);
+        out << "drops " << stats.drops << "\n" << "socket-drops " << stats.socketDrops << "\n";
+        if (!out)
+            return false;
+    }
+    return rename(tmp.c_str(), path.c_str()) == 0;
+}
+
+bool readServerStats(const string& path, server_stats_t& stats) {
+    ifstream in(path);
+    string name;
+    long long value;
+    bool any = false;
+    while (in >> name >> value) {
+        if (name == "drops")
+            stats.drops = value;
+        else if (name == "socket-drops")
+            stats.socketDrops = value;
+        any = true;
+    }
+    return any;
+}
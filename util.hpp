@@ -1,5 +1,7 @@
 #include <stdlib.h>
 
+#pragma once
+
 const int MAX_PACKET_SIZE = 524; // 512 bytes of payload + 12 bytes of header
 const int MAX_PAYLOAD_SIZE = 512; // 512 bytes
 const int MAX_SEQ_NUM = 102401;
@@ -10,6 +12,7 @@ const int TIMEOUT_TIMER = 10000; // 10 seconds or 10000 miliseconds
 const int MAX_CWND = 51200; // bytes
 const int RWND = 51200; // bytes
 const int INIT_SS_THRESH = 10000; // bytes
+const uint64_t MAX_FILE_SIZE = 100 * 1024 * 1024; // 100 MB, the largest file the protocol carries
 
 
 uint32_t buf2int(const char *s, size_t a, size_t b) {